@@ -0,0 +1,836 @@
+/**
+ *   Copyright 2015 Garrick Toubassi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <alloca.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "gc.h"
+
+/**
+ *  simplegc_bench runs a set of allocation workloads against different
+ *  allocators so SimpleGC can be compared with baselines:
+ *
+ *    malloc    calloc/free, with the workload freeing blocks manually
+ *    simplegc  gc_alloc, nothing is freed explicitly
+ *    boehm     GC_MALLOC from the Boehm-Demers-Weiser collector.  Only
+ *              built when BENCH_BOEHM is defined, in which case bdwgc's
+ *              headers (gc/gc.h) must be on the include path and -lgc
+ *              must be linked.
+ *
+ *  Each workload/allocator pair runs in its own forked process so that its
+ *  peak RSS can be measured in isolation, and results are printed as one
+ *  table of throughput, worst single operation (which includes any GC
+ *  pause it triggered) and peak RSS.
+ *
+ *  With --sweep, each workload instead runs against SimpleGC once per heap
+ *  limit (gc_set_max_heap) in --heaps (MB, comma separated), and the
+ *  throughput/footprint trade-off is written as CSV: heap size, fraction of
+ *  time spent in GC, pause p50/p99 and allocations per second.
+ *
+ *  With --latency, a request loop runs at a fixed arrival rate (--rate per
+ *  second, --requests in total) against one allocator (simplegc unless
+ *  --allocator is given), each request allocating a small object graph and
+ *  caching part of it.  Latency is measured from when a request was due to
+ *  start rather than when it did, so requests queued behind a GC pause are
+ *  charged for it (correcting for coordinated omission).  Both that and the
+ *  uncorrected service time are reported as HDR style histograms.
+ *
+ *  With --threads, 1 up to --max-threads threads (default: the number of
+ *  cores) each churn through allocations of --object-size bytes that stay
+ *  live for --lifetime of the thread's allocations, and with probability
+ *  --share also replace a block in a table shared by all threads.  For
+ *  each thread count it reports allocations/sec per thread and the
+ *  collection pauses.  SimpleGC (and Boehm as built here) isn't thread
+ *  safe, so its allocations and the stores that publish them are
+ *  serialized by a lock in the benchmark, which also guarantees every live
+ *  block is reachable from the roots when any thread collects.
+ *
+ *  With --noise, SimpleGC's false retention is measured.  A heap of blocks
+ *  is allocated of which the benchmark keeps every tenth (the oracle's
+ *  precise live set), then a table of globals, the stack and the payload
+ *  of the live blocks are filled with --noise-words of pointer-like noise of
+ *  each --noise-kind: random 64 bit values, hashes of small integers,
+ *  timestamps, and adversarial values (the addresses of dead blocks and
+ *  words near them).  After a collection, whatever the heap holds beyond
+ *  the oracle's live set was falsely retained.  The globals are a root
+ *  declared with gc_heap_add_root rather than a static array, so the other
+ *  modes' collections don't spend time scanning it.
+ *
+ *  usage: simplegc_bench [--workload name] [--allocator name] [--scale n]
+ *                        [--sweep [--heaps mb,mb,...]]
+ *                        [--latency [--rate n] [--requests n]]
+ *                        [--threads [--max-threads n] [--object-size bytes]
+ *                                   [--lifetime n] [--share fraction]]
+ *                        [--noise [--noise-kind name] [--noise-words n]]
+ */
+
+#ifdef BENCH_BOEHM
+#include <gc/gc.h>
+#endif
+
+// Keeps the workloads' working sets reachable.  Root arrays are allocated
+// with the allocator under test, so for a collector they must be referenced
+// from somewhere it scans.
+static void **bench_root;
+
+static uint64_t max_op_ns;
+
+struct malloc_allocator {
+  static const bool thread_safe = true;
+  static void init() {}
+  static void *alloc(size_t size) { return calloc(1, size); }
+  static void release(void *ptr) { free(ptr); }
+};
+
+struct simplegc_allocator {
+  static const bool thread_safe = false;
+  static void init() {}
+  static void *alloc(size_t size) { return gc_alloc(size); }
+  static void release(void *ptr) {}
+};
+
+#ifdef BENCH_BOEHM
+struct boehm_allocator {
+  static const bool thread_safe = false;
+  static void init() { GC_INIT(); }
+  static void *alloc(size_t size) { return GC_MALLOC(size); }
+  static void release(void *ptr) {}
+};
+#endif
+
+/**
+ *  Allocates through A, recording the slowest single allocation
+ */
+template <typename A>
+static void *timed_alloc(size_t size) {
+  uint64_t start_ns = gc_now_ns();
+  void *ptr = A::alloc(size);
+  uint64_t elapsed_ns = gc_now_ns() - start_ns;
+  if (elapsed_ns > max_op_ns) {
+    max_op_ns = elapsed_ns;
+  }
+  if (!ptr) {
+    fprintf(stderr, "Allocation of %zu bytes failed\n", size);
+    exit(1);
+  }
+  return ptr;
+}
+
+/**
+ *  Keeps a rolling window of small, variously sized blocks alive, replacing
+ *  one per operation.  Returns the number of allocations.
+ */
+template <typename A>
+static size_t workload_churn(size_t scale) {
+  const size_t window = 16 * 1024;
+  bench_root = (void **)timed_alloc<A>(window * sizeof(void *));
+  size_t ops = scale * 1000 * 1000;
+  for (size_t i = 0; i < ops; i++) {
+    size_t slot = (i * 7919) % window;
+    if (bench_root[slot]) {
+      A::release(bench_root[slot]);
+    }
+    bench_root[slot] = timed_alloc<A>(16 + (i % 16) * 16);
+  }
+  for (size_t slot = 0; slot < window; slot++) {
+    if (bench_root[slot]) {
+      A::release(bench_root[slot]);
+    }
+  }
+  A::release(bench_root);
+  bench_root = 0;
+  return ops + 1;
+}
+
+struct tree_node {
+  tree_node *left;
+  tree_node *right;
+};
+
+template <typename A>
+static tree_node *make_tree(int depth, size_t &ops) {
+  tree_node *node = (tree_node *)timed_alloc<A>(sizeof(tree_node));
+  ops++;
+  if (depth > 0) {
+    node->left = make_tree<A>(depth - 1, ops);
+    node->right = make_tree<A>(depth - 1, ops);
+  }
+  return node;
+}
+
+template <typename A>
+static void free_tree(tree_node *node) {
+  if (node) {
+    free_tree<A>(node->left);
+    free_tree<A>(node->right);
+    A::release(node);
+  }
+}
+
+/**
+ *  The classic binary trees benchmark: one long lived tree while many
+ *  short lived ones are built and dropped.
+ */
+template <typename A>
+static size_t workload_trees(size_t scale) {
+  size_t ops = 0;
+  bench_root = (void **)make_tree<A>(16, ops);
+  for (size_t i = 0; i < scale * 64; i++) {
+    free_tree<A>(make_tree<A>(12, ops));
+  }
+  free_tree<A>((tree_node *)bench_root);
+  bench_root = 0;
+  return ops;
+}
+
+/**
+ *  Grows a long lived linked list of larger nodes while producing
+ *  temporary garbage, so the live set grows over the run.
+ */
+template <typename A>
+static size_t workload_list(size_t scale) {
+  size_t ops = 0;
+  size_t nodes = scale * 20 * 1000;
+  for (size_t i = 0; i < nodes; i++) {
+    void **node = (void **)timed_alloc<A>(256);
+    node[0] = bench_root;
+    bench_root = node;
+    for (int j = 0; j < 16; j++) {
+      A::release(timed_alloc<A>(64));
+    }
+    ops += 17;
+  }
+  while (bench_root) {
+    void **next = (void **)bench_root[0];
+    A::release(bench_root);
+    bench_root = next;
+  }
+  return ops;
+}
+
+// Configuration of the --threads workload
+static const int max_bench_threads = 256;
+static int bench_threads = 1;
+static size_t thread_object_size = 64;
+static size_t thread_lifetime = 4096;
+static double thread_share = 0.05;
+static const size_t shared_table_size = 4096;
+
+// Per thread windows of live blocks, and the table blocks are shared through
+static void **thread_roots[max_bench_threads];
+static void **shared_root;
+static std::mutex bench_lock;
+
+template <typename A>
+static void churn_thread(int thread, size_t ops) {
+  std::unique_lock<std::mutex> lock(bench_lock, std::defer_lock);
+  uint64_t random = thread * 0x9e3779b97f4a7c15ULL + 1;
+  uint64_t share_threshold = (uint64_t)(thread_share * UINT32_MAX);
+  void **window = thread_roots[thread];
+  
+  for (size_t i = 0; i < ops; i++) {
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    
+    // malloc is thread safe, and the shared table has its own locking below
+    if (!A::thread_safe) {
+      lock.lock();
+    }
+    void *displaced = window[i % thread_lifetime];
+    window[i % thread_lifetime] = timed_alloc<A>(thread_object_size);
+    A::release(displaced);
+    
+    if ((random & UINT32_MAX) < share_threshold) {
+      if (A::thread_safe) {
+        lock.lock();
+      }
+      // Read a block some other thread published and replace it with ours
+      void **slot = &shared_root[(random >> 32) % shared_table_size];
+      volatile char touched = *slot ? *(char *)*slot : 0;
+      (void)touched;
+      displaced = *slot;
+      *slot = timed_alloc<A>(thread_object_size);
+      A::release(displaced);
+      if (A::thread_safe) {
+        lock.unlock();
+      }
+    }
+    if (!A::thread_safe) {
+      lock.unlock();
+    }
+  }
+}
+
+/**
+ *  Runs bench_threads threads of churn_thread, returning total allocations
+ */
+template <typename A>
+static size_t workload_threads(size_t scale) {
+  size_t ops = scale * 200 * 1000;
+  shared_root = (void **)timed_alloc<A>(shared_table_size * sizeof(void *));
+  for (int i = 0; i < bench_threads; i++) {
+    thread_roots[i] = (void **)timed_alloc<A>(thread_lifetime * sizeof(void *));
+  }
+  
+  std::vector<std::thread> threads;
+  for (int i = 0; i < bench_threads; i++) {
+    threads.push_back(std::thread(churn_thread<A>, i, ops));
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return ops * bench_threads;
+}
+
+// Configuration and results of the --noise workload
+enum noise_kind { NOISE_RANDOM, NOISE_HASH, NOISE_TIME, NOISE_ADVERSARIAL };
+static const char *noise_kind_names[] = { "random", "hash", "time", "adversarial" };
+static noise_kind bench_noise_kind;
+static size_t noise_words = 64 * 1024;
+static size_t oracle_live_bytes;
+static size_t oracle_garbage_bytes;
+
+struct noise_source {
+  noise_kind kind;
+  uint64_t state;
+  const std::vector<uint64_t> *dead;
+  
+  uint64_t next() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    switch (kind) {
+      case NOISE_RANDOM:
+        return state;
+      case NOISE_HASH: {
+        // FNV-1a of a small integer, like a hash table full of int keys
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (uint64_t key = state % 100000; key; key >>= 8) {
+          hash = (hash ^ (key & 0xff)) * 0x100000001b3ULL;
+        }
+        return hash;
+      }
+      case NOISE_TIME:
+        return (state & 1) ? gc_now_ns() + state % 1000 : (uint64_t)time(0) * 1000000 + state % 1000000;
+      case NOISE_ADVERSARIAL: {
+        // Exact addresses of dead blocks, or words just inside them
+        uint64_t address = (*dead)[state % dead->size()];
+        return (state >> 32) & 1 ? address : address + ((state >> 33) % 8) * sizeof(void *);
+      }
+    }
+    return state;
+  }
+};
+
+/**
+ *  Collects from a frame holding words of stack noise
+ */
+static void __attribute__((noinline)) collect_with_stack_noise(noise_source &noise, size_t words) {
+  volatile uint64_t *stack_noise = (volatile uint64_t *)alloca(words * sizeof(uint64_t));
+  for (size_t i = 0; i < words; i++) {
+    stack_noise[i] = noise.next();
+  }
+  gc_collect();
+}
+
+template <typename A>
+static size_t workload_noise(size_t scale) {
+  size_t blocks = scale * 100 * 1000;
+  bench_root = (void **)timed_alloc<A>((blocks / 10 + 1) * sizeof(void *));
+  oracle_live_bytes = (blocks / 10 + 1) * sizeof(void *);
+  oracle_garbage_bytes = 0;
+  
+  std::vector<uint64_t> dead;
+  size_t live = 0;
+  for (size_t i = 0; i < blocks; i++) {
+    size_t size = 64 + (i % 16) * 64;
+    void *block = timed_alloc<A>(size);
+    if (i % 10 == 0) {
+      bench_root[live++] = block;
+      oracle_live_bytes += size;
+    }
+    else {
+      dead.push_back((uint64_t)block);
+      oracle_garbage_bytes += size;
+    }
+  }
+  
+  noise_source noise = { bench_noise_kind, 0x2545f4914f6cdd1dULL, &dead };
+  size_t global_words = noise_words / 3;
+  uint64_t *global_noise = (uint64_t *)malloc(global_words * sizeof(uint64_t));
+  for (size_t i = 0; i < global_words; i++) {
+    global_noise[i] = noise.next();
+  }
+  gc_heap_add_root(0, global_noise, global_words * sizeof(uint64_t));
+  size_t heap_words = noise_words / 3;
+  for (size_t i = 0; i < heap_words; i++) {
+    uint64_t *block = (uint64_t *)bench_root[i % live];
+    block[1 + (i / live) % 7] = noise.next();
+  }
+  collect_with_stack_noise(noise, noise_words - global_words - heap_words);
+  gc_heap_remove_root(0, global_noise);
+  free(global_noise);
+  return blocks + 1;
+}
+
+struct bench_result {
+  size_t ops;
+  uint64_t elapsed_ns;
+  uint64_t max_op_ns;
+  gc_stats gc;      // Only meaningful for simplegc
+  size_t oracle_live_bytes;
+  size_t oracle_garbage_bytes;
+};
+
+typedef size_t (*workload_fn)(size_t scale);
+
+struct workload {
+  const char *name;
+  workload_fn malloc_fn;
+  workload_fn simplegc_fn;
+  workload_fn boehm_fn;
+};
+
+#ifdef BENCH_BOEHM
+#define WORKLOAD(name) { #name, workload_##name<malloc_allocator>, workload_##name<simplegc_allocator>, workload_##name<boehm_allocator> }
+#else
+#define WORKLOAD(name) { #name, workload_##name<malloc_allocator>, workload_##name<simplegc_allocator>, 0 }
+#endif
+
+static const workload workloads[] = {
+  WORKLOAD(churn),
+  WORKLOAD(trees),
+  WORKLOAD(list),
+};
+
+static const char *allocator_names[] = { "malloc", "simplegc", "boehm" };
+
+static workload_fn allocator_fn(const workload &w, int allocator) {
+  return allocator == 0 ? w.malloc_fn : allocator == 1 ? w.simplegc_fn : w.boehm_fn;
+}
+
+static void allocator_init(int allocator) {
+  if (allocator == 0) {
+    malloc_allocator::init();
+  }
+  else if (allocator == 1) {
+    simplegc_allocator::init();
+  }
+#ifdef BENCH_BOEHM
+  else {
+    boehm_allocator::init();
+  }
+#endif
+}
+
+/**
+ *  Runs fn in a child process, returning false if it failed.  The child's
+ *  peak RSS is returned in bytes.
+ */
+static bool run_isolated(workload_fn fn, int allocator, size_t scale, size_t max_heap, bench_result *result, size_t *peak_rss) {
+  int fds[2];
+  if (pipe(fds)) {
+    perror("pipe");
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    allocator_init(allocator);
+    gc_set_max_heap(max_heap);
+    bench_result child;
+    max_op_ns = 0;
+    uint64_t start_ns = gc_now_ns();
+    child.ops = fn(scale);
+    child.elapsed_ns = gc_now_ns() - start_ns;
+    child.max_op_ns = max_op_ns;
+    gc_get_stats(&child.gc);
+    child.oracle_live_bytes = oracle_live_bytes;
+    child.oracle_garbage_bytes = oracle_garbage_bytes;
+    ssize_t written = write(fds[1], &child, sizeof(child));
+    _exit(written == sizeof(child) ? 0 : 1);
+  }
+
+  close(fds[1]);
+  bool ok = read(fds[0], result, sizeof(*result)) == sizeof(*result);
+  close(fds[0]);
+
+  int status;
+  struct rusage usage;
+  if (pid < 0 || wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return false;
+  }
+#ifdef __APPLE__
+  *peak_rss = usage.ru_maxrss;
+#else
+  *peak_rss = usage.ru_maxrss * 1024;
+#endif
+  return ok;
+}
+
+/**
+ *  Log-linear histogram in the style of HdrHistogram: values below 128 are
+ *  exact, above that each power of two is split into 64 buckets, so values
+ *  are recorded with better than 2% precision over the whole 64 bit range.
+ */
+struct latency_histogram {
+  static const int buckets = 128 + 57 * 64;
+  uint64_t counts[buckets];
+  uint64_t total;
+  uint64_t max;
+  
+  latency_histogram() : total(0), max(0) {
+    memset(counts, 0, sizeof(counts));
+  }
+  
+  static int index_of(uint64_t value) {
+    if (value < 128) {
+      return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - 6;
+    return 128 + (shift - 1) * 64 + (int)((value >> shift) - 64);
+  }
+  
+  // Highest value that lands in bucket index
+  static uint64_t value_of(int index) {
+    if (index < 128) {
+      return index;
+    }
+    int shift = (index - 128) / 64 + 1;
+    uint64_t mantissa = (index - 128) % 64 + 64;
+    return (mantissa << shift) + ((uint64_t)1 << shift) - 1;
+  }
+  
+  void record(uint64_t value) {
+    counts[index_of(value)]++;
+    total++;
+    if (value > max) {
+      max = value;
+    }
+  }
+  
+  uint64_t percentile(double percentile) const {
+    uint64_t target = (uint64_t)(percentile / 100 * total + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < buckets; i++) {
+      seen += counts[i];
+      if (seen >= target && seen > 0) {
+        return std::min(value_of(i), max);
+      }
+    }
+    return max;
+  }
+};
+
+// Blocks cached across requests, standing in for a server's caches
+static const size_t latency_cache_size = 4 * 1024;
+
+/**
+ *  Runs requests at rate per second.  Each one builds a short list of
+ *  temporaries, keeps its head in the cache (displacing an older one)
+ *  and drops the rest.
+ */
+template <typename A>
+static void latency_requests(double rate, size_t requests, latency_histogram *corrected, latency_histogram *service) {
+  A::init();
+  bench_root = (void **)timed_alloc<A>(latency_cache_size * sizeof(void *));
+  
+  uint64_t interval_ns = (uint64_t)(1e9 / rate);
+  uint64_t start_ns = gc_now_ns();
+  for (size_t i = 0; i < requests; i++) {
+    uint64_t due_ns = start_ns + i * interval_ns;
+    uint64_t begin_ns;
+    while ((begin_ns = gc_now_ns()) < due_ns) {
+      // Spin, sleeping would add its own jitter
+    }
+    
+    void **head = 0;
+    for (int j = 0; j < 32; j++) {
+      void **node = (void **)timed_alloc<A>(64 + (j % 4) * 64);
+      node[0] = head;
+      head = node;
+    }
+    size_t slot = (i * 7919) % latency_cache_size;
+    void **displaced = (void **)bench_root[slot];
+    bench_root[slot] = head;
+    while (displaced) {
+      void **next = (void **)displaced[0];
+      A::release(displaced);
+      displaced = next;
+    }
+    
+    uint64_t end_ns = gc_now_ns();
+    corrected->record(end_ns - due_ns);
+    service->record(end_ns - begin_ns);
+  }
+}
+
+static void run_latency(int allocator, double rate, size_t requests) {
+  // About 30KB each, so kept off the stack (which the collector scans) and
+  // out of the data segment
+  latency_histogram *corrected = new latency_histogram;
+  latency_histogram *service = new latency_histogram;
+  if (allocator == 0) {
+    latency_requests<malloc_allocator>(rate, requests, corrected, service);
+  }
+  else if (allocator == 1) {
+    latency_requests<simplegc_allocator>(rate, requests, corrected, service);
+  }
+#ifdef BENCH_BOEHM
+  else {
+    latency_requests<boehm_allocator>(rate, requests, corrected, service);
+  }
+#endif
+  
+  printf("%s, %zu requests at %.0f/sec\n", allocator_names[allocator], requests, rate);
+  printf("%-10s %16s %16s\n", "percentile", "latency (ms)", "service (ms)");
+  const double percentiles[] = { 50, 90, 99, 99.9, 99.99, 100 };
+  for (double percentile : percentiles) {
+    printf("%-10g %16.3f %16.3f\n", percentile, corrected->percentile(percentile) / 1e6, service->percentile(percentile) / 1e6);
+  }
+  if (allocator == 1) {
+    gc_stats stats;
+    gc_get_stats(&stats);
+    printf("%zu collections, max pause %.3f ms\n", stats.collections, stats.pause_max_ns / 1e6);
+  }
+  delete corrected;
+  delete service;
+}
+
+static void run_threads(int allocator, size_t scale, int max_threads) {
+  if (max_threads > max_bench_threads) {
+    max_threads = max_bench_threads;
+  }
+  workload_fn fns[] = {
+    workload_threads<malloc_allocator>,
+    workload_threads<simplegc_allocator>,
+#ifdef BENCH_BOEHM
+    workload_threads<boehm_allocator>,
+#else
+    0,
+#endif
+  };
+  
+  printf("%s, %zu byte objects, lifetime %zu, %.0f%% shared\n", allocator_names[allocator], thread_object_size,
+         thread_lifetime, thread_share * 100);
+  printf("%8s %18s %16s %12s %14s %14s\n", "threads", "allocs/sec/thread", "allocs/sec", "collections", "p99 pause ms", "max pause ms");
+  for (bench_threads = 1; bench_threads <= max_threads; bench_threads++) {
+    bench_result result;
+    size_t peak_rss;
+    if (!run_isolated(fns[allocator], allocator, scale, 0, &result, &peak_rss)) {
+      printf("%8d %18s\n", bench_threads, "FAILED");
+      continue;
+    }
+    double rate = result.ops * 1e9 / result.elapsed_ns;
+    printf("%8d %18.0f %16.0f %12zu %14.3f %14.3f\n", bench_threads, rate / bench_threads, rate,
+           result.gc.collections, result.gc.pause_p99_ns / 1e6, result.gc.pause_max_ns / 1e6);
+    fflush(stdout);
+  }
+}
+
+static void run_noise(size_t scale, const char *only_kind) {
+  printf("%zu noise words split between globals, stack and live blocks\n", noise_words);
+  printf("%-12s %14s %14s %16s %10s\n", "noise", "live bytes", "garbage bytes", "retained bytes", "retained");
+  for (int kind = NOISE_RANDOM; kind <= NOISE_ADVERSARIAL; kind++) {
+    if (only_kind && strcmp(only_kind, noise_kind_names[kind])) {
+      continue;
+    }
+    bench_noise_kind = (noise_kind)kind;
+    bench_result result;
+    size_t peak_rss;
+    if (!run_isolated(workload_noise<simplegc_allocator>, 1, scale, 0, &result, &peak_rss)) {
+      printf("%-12s %14s\n", noise_kind_names[kind], "FAILED");
+      continue;
+    }
+    size_t retained = result.gc.heap_bytes > result.oracle_live_bytes ? result.gc.heap_bytes - result.oracle_live_bytes : 0;
+    printf("%-12s %14zu %14zu %16zu %9.2f%%\n", noise_kind_names[kind], result.oracle_live_bytes,
+           result.oracle_garbage_bytes, retained, 100.0 * retained / result.oracle_garbage_bytes);
+    fflush(stdout);
+  }
+}
+
+static void usage(const char *program) {
+  fprintf(stderr, "usage: %s [--workload name] [--allocator malloc|simplegc|boehm] [--scale n]\n"
+                  "       [--sweep [--heaps mb,mb,...]]\n"
+                  "       [--latency [--rate n] [--requests n]]\n"
+                  "       [--threads [--max-threads n] [--object-size bytes] [--lifetime n] [--share fraction]]\n"
+                  "       [--noise [--noise-kind random|hash|time|adversarial] [--noise-words n]]\n", program);
+  exit(2);
+}
+
+/**
+ *  Runs each workload on SimpleGC across a range of heap limits, as CSV
+ */
+static void run_sweep(const char *only_workload, size_t scale, const std::vector<size_t> &heaps) {
+  printf("workload,heap_bytes,gc_time_fraction,pause_p50_ms,pause_p99_ms,allocs_per_sec\n");
+  for (const workload &w : workloads) {
+    if (only_workload && strcmp(only_workload, w.name)) {
+      continue;
+    }
+    for (size_t heap : heaps) {
+      bench_result result;
+      size_t peak_rss;
+      if (!run_isolated(w.simplegc_fn, 1, scale, heap, &result, &peak_rss)) {
+        fprintf(stderr, "%s did not fit in a %zu byte heap\n", w.name, heap);
+        continue;
+      }
+      printf("%s,%zu,%.4f,%.3f,%.3f,%.0f\n", w.name, heap, (double)result.gc.total_pause_ns / result.elapsed_ns,
+             result.gc.pause_p50_ns / 1e6, result.gc.pause_p99_ns / 1e6, result.ops * 1e9 / result.elapsed_ns);
+      fflush(stdout);
+    }
+  }
+}
+
+int main(int argc, const char * argv[]) {
+  const char *only_workload = 0;
+  const char *only_allocator = 0;
+  size_t scale = 1;
+  bool sweep = false;
+  const char *heaps = "4,8,16,32,64,128,256";
+  bool latency = false;
+  double rate = 20000;
+  size_t requests = 200000;
+  bool threads = false;
+  bool noise = false;
+  const char *only_noise_kind = 0;
+  int max_threads = std::thread::hardware_concurrency();
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "--workload") && has_value) {
+      only_workload = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--allocator") && has_value) {
+      only_allocator = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--scale") && has_value) {
+      scale = strtoull(argv[++i], 0, 10);
+    }
+    else if (!strcmp(argv[i], "--sweep")) {
+      sweep = true;
+    }
+    else if (!strcmp(argv[i], "--heaps") && has_value) {
+      heaps = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--latency")) {
+      latency = true;
+    }
+    else if (!strcmp(argv[i], "--rate") && has_value) {
+      rate = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--requests") && has_value) {
+      requests = strtoull(argv[++i], 0, 10);
+    }
+    else if (!strcmp(argv[i], "--threads")) {
+      threads = true;
+    }
+    else if (!strcmp(argv[i], "--max-threads") && has_value) {
+      max_threads = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--object-size") && has_value) {
+      thread_object_size = std::max(8ULL, strtoull(argv[++i], 0, 10));
+    }
+    else if (!strcmp(argv[i], "--lifetime") && has_value) {
+      thread_lifetime = std::max(1ULL, strtoull(argv[++i], 0, 10));
+    }
+    else if (!strcmp(argv[i], "--share") && has_value) {
+      thread_share = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--noise")) {
+      noise = true;
+    }
+    else if (!strcmp(argv[i], "--noise-kind") && has_value) {
+      only_noise_kind = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--noise-words") && has_value) {
+      noise_words = strtoull(argv[++i], 0, 10);
+    }
+    else {
+      usage(argv[0]);
+    }
+  }
+
+  if (sweep) {
+    std::vector<size_t> heap_sizes;
+    for (const char *p = heaps; *p; p += strspn(p, ",")) {
+      char *end;
+      heap_sizes.push_back(strtoull(p, &end, 10) * 1024 * 1024);
+      if (end == p) {
+        usage(argv[0]);
+      }
+      p = end;
+    }
+    run_sweep(only_workload, scale, heap_sizes);
+    return 0;
+  }
+  if (noise) {
+    run_noise(scale, only_noise_kind);
+    return 0;
+  }
+  if (latency || threads) {
+    int allocator = 1;
+    for (int i = 0; only_allocator && i < 3; i++) {
+      if (!strcmp(only_allocator, allocator_names[i])) {
+        allocator = i;
+      }
+    }
+#ifndef BENCH_BOEHM
+    if (allocator == 2) {
+      fprintf(stderr, "Built without BENCH_BOEHM\n");
+      return 1;
+    }
+#endif
+    if (latency) {
+      run_latency(allocator, rate, requests);
+    }
+    else {
+      run_threads(allocator, scale, max_threads);
+    }
+    return 0;
+  }
+
+  printf("%-10s %-10s %14s %14s %12s\n", "workload", "allocator", "ops/sec", "max op (ms)", "peak RSS MB");
+  for (const workload &w : workloads) {
+    if (only_workload && strcmp(only_workload, w.name)) {
+      continue;
+    }
+    for (int allocator = 0; allocator < 3; allocator++) {
+      workload_fn fn = allocator_fn(w, allocator);
+      if (!fn || (only_allocator && strcmp(only_allocator, allocator_names[allocator]))) {
+        continue;
+      }
+      bench_result result;
+      size_t peak_rss;
+      if (!run_isolated(fn, allocator, scale, 0, &result, &peak_rss)) {
+        printf("%-10s %-10s %14s\n", w.name, allocator_names[allocator], "FAILED");
+        continue;
+      }
+      printf("%-10s %-10s %14.0f %14.3f %12.1f\n", w.name, allocator_names[allocator],
+             result.ops * 1e9 / result.elapsed_ns, result.max_op_ns / 1e6, peak_rss / (1024.0 * 1024.0));
+      fflush(stdout);
+    }
+  }
+  return 0;
+}
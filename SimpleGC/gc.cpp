@@ -17,38 +17,336 @@
 #include <cstdio>
 #include <cstdarg>
 #include <iostream>
+#include <chrono>
 
 #include <mach-o/getsect.h>
 #include <mach/mach_vm.h>
 #include <mach/mach.h>
 #include <mach-o/dyld.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
 #include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <thread>
 
 #include "gc.h"
+#include "gc_trace.h"
 
 
 static void debug_printf(const char *format, ...);
+static void gc_init_thread_stack(void);
+static uint64_t now_ns();
+static bool gc_sweep_step(size_t budget_bytes);
+struct gc_block;
+static void gc_reclaim_block(void *ptr, const gc_block &block, uint8_t reason);
+static void gc_collect_within(uint64_t budget_ns, bool record_pause, uint8_t trigger);
+static void gc_trace(uint8_t event, uint8_t flags, uint32_t site, const void *address, uint64_t value, uint8_t tag);
+static void gc_sweep_assist(size_t size);
 static inline uint64_t get_stack_pointer();
 static void get_registers(void **buffer);
 
 // Track the stack segment.  This is part of the "root set" that
-// we scan during collections.
-static void **stack_start;
-static mach_vm_size_t stack_length;
+// we scan during collections.  Each thread has its own, and a
+// collection scans the stack of the thread that runs it.
+static __thread void **stack_start;
+static __thread mach_vm_size_t stack_length;
 
 // Track the data segment (e.g. initialized and uninitialized globals.
 // This is part of the "root set" that we scan during collections.
 static void **data_segment_start;
 static mach_vm_size_t data_segment_length;
 
+// What we keep about each managed block
+struct gc_block {
+  size_t size;
+  uint32_t site;    // Index into census_sites, 0 when the census is off
+  uint8_t flags;    // GC_BLOCK_*
+  uint8_t tag;      // From gc_alloc_tagged, 0 for untagged blocks
+  uint16_t tracer;  // Index into tracers, 0 to scan it conservatively
+};
+
+enum {
+  GC_BLOCK_ATOMIC = 0x01,   // Holds no pointers, its contents are never scanned
+  GC_BLOCK_MAPPED = 0x02,   // A gc_alloc_mapped_file mapping, munmap'd rather than freed
+  GC_BLOCK_POOLED = 0x04,   // A gc_buffer_alloc buffer, returned to its pool rather than freed
+  GC_BLOCK_FRAME = 0x08,    // A gc_alloc_frame frame, kept in a frame cache rather than freed
+};
+
+/**
+ *  The bytes a block costs the heap, i.e. what counts towards the pacer's
+ *  goal and the heap limit.  Mapped files are backed by the file instead,
+ *  and pool buffers by their pool.
+ */
+static inline size_t gc_block_heap_bytes(const gc_block &block) {
+  return block.flags & (GC_BLOCK_MAPPED | GC_BLOCK_POOLED) ? 0 : block.size;
+}
+
 // Track every "managed" block we've allocated.  Maps the pointer to the
-// size of the block.
-typedef std::unordered_map<void *, size_t> heapmap;
+// block's size and metadata.
+typedef std::unordered_map<void *, gc_block> heapmap;
 static heapmap *allocations;
 
-// Debugging constant to enforce an arbitrary heap size
+// Lowest and highest block addresses ever allocated, so scanning can reject
+// most words with a range check before looking them up.  Like the maps,
+// address ranges live outside the data segment, which is scanned as a root
+// and would otherwise keep the blocks at either end alive.
+struct gc_range {
+  void *min;
+  void *max;
+};
+static gc_range *heap_range;
+
+// Pointer decoding set by gc_set_pointer_decoding.  A scanned word that
+// isn't itself a block's address is looked up again as word & pointer_mask.
+static uint64_t pointer_mask = UINT64_MAX;
+
+// Memory ranges declared with gc_heap_add_root, scanned in addition to the
+// registers, stack and data segment
+typedef std::vector<std::pair<void *, size_t>> rootlist;
+static rootlist default_roots;
+
+// Heaps created with gc_heap_create.  Each has its own blocks, pacing and
+// stats, and is collected on its own.  The default heap used by gc_alloc
+// keeps the equivalent state in the globals of this file.
+struct gc_heap {
+  heapmap *allocations;
+  void *min;
+  void *max;
+  size_t current_allocated;
+  size_t max_heap_size;
+  size_t heap_goal;
+  size_t collections;
+  size_t live_bytes;
+  uint64_t last_pause_ns;
+  uint64_t total_pause_ns;
+  rootlist roots;
+  bool thread_local_roots;  // A gc_thread_heap, rooted only in its thread's stack
+  std::mutex lock;          // Held by the owning thread while it changes a gc_thread_heap
+};
+
+// The calling thread's heap while gc_thread_heap is enabled, and all such
+// heaps, whose blocks are roots for collections of the shared heap
+static __thread gc_heap *thread_heap = 0;
+static std::vector<gc_heap *> thread_heaps;
+static std::mutex thread_heaps_lock;
+
+// Every heap made by gc_heap_create (thread heaps included), so gc_free
+// can find the heap a block belongs to
+static std::vector<gc_heap *> heaps;
+static std::mutex heaps_lock;
+
+// Fiber stacks registered with gc_register_stack, plus each thread's own
+// stack once it has switched to a fiber.  A suspended stack is scanned
+// from the stack pointer it was suspended at.  One that hasn't run (or
+// been touched) since the last collection can't have changed, so the
+// words that pointed at blocks then (its hits) are reused instead of
+// scanning it again.  Dirty stacks are scanned in parallel when there
+// are enough of them.
+struct gc_stack {
+  void *base;
+  size_t size;
+  void *saved_sp;     // 0 while running
+  bool dirty;         // Run or touched since its hits were taken
+  size_t index;       // In fiber_stacks
+  std::vector<void *> hits;
+};
+static std::vector<gc_stack *> fiber_stacks;
+static std::mutex fiber_stacks_lock;
+static __thread gc_stack *current_stack = 0;  // The fiber this thread runs on, 0 for its own stack
+static __thread gc_stack *own_stack = 0;      // This thread's stack, once it has switched away
+static const size_t parallel_scan_min_bytes = 1024 * 1024;
+static size_t stacks_scanned = 0;
+static size_t stacks_cached = 0;
+
+// Shadow stack of precise roots (see gc_push_root) and whether this thread
+// is scanned through it instead of conservatively.  The array is malloc'd,
+// it holds addresses of the thread's locals, which are never blocks.
+static __thread void ***shadow_stack = 0;
+static __thread size_t shadow_depth = 0;
+static __thread size_t shadow_capacity = 0;
+static __thread bool precise_roots = false;
+
+// What a gc_mark_ctx user reported, marked once it returns.  Collecting
+// references first and marking after lets root callbacks run in parallel.
+struct gc_mark_ctx {
+  std::vector<void *> pointers;   // From gc_mark_precise
+  rootlist ranges;                // From gc_mark_range
+};
+
+// Trace functions of gc_alloc_traced blocks, which name them by index.
+// Index 0 is reserved for conservatively scanned blocks.
+static std::vector<gc_trace_fn> tracers(1);
+static std::unordered_map<gc_trace_fn, uint16_t> tracer_indexes;
+
+// Root callbacks added with gc_add_root_callback.  They only get worker
+// threads once they took parallel_callbacks_min_ns at the last collection,
+// so cheap callbacks don't pay for starting threads.
+static std::vector<std::pair<gc_root_callback, void *>> root_callbacks;
+static const uint64_t parallel_callbacks_min_ns = 1000 * 1000;
+static uint64_t root_callbacks_ns = 0;
+
+// Heap limit set by gc_set_max_heap, 0 for none
 static size_t max_heap_size = 0;
 static size_t current_allocated = 0;
+static size_t mapped_bytes = 0;
+
+// The reserve set up by gc_reserve.  Blocks are carved from it before
+// falling back to calloc, and reclaimed ones go on a free list for their
+// size (rounded up to reserve_granule) to be reused.  Like gc_range it
+// lives on the C heap so the data segment scan doesn't see base.
+static const size_t reserve_granule = 16;
+
+struct gc_reserve_area {
+  char *base;
+  size_t size;
+  size_t used;        // Bytes carved from base so far
+  std::unordered_map<size_t, std::vector<void *>> free_blocks;
+};
+
+static gc_reserve_area *reserve;
+
+static inline size_t gc_reserve_round(size_t size) {
+  return std::max(reserve_granule, (size + reserve_granule - 1) & ~(reserve_granule - 1));
+}
+
+// Page faults the process had taken when the collector started
+static long page_faults_at_init;
+
+// Frame caches for gc_alloc_frame.  Frames are rounded up to a multiple of
+// frame_class_bytes, and reclaimed frames are kept on their size class's
+// list (up to frame_cache_limit of them) for the next frame of that size.
+// Cached frames don't count towards the heap, so each collection frees the
+// ones that sat unused since the previous one: frame_cache_low is the
+// fewest frames each list held in that time.
+static const size_t frame_class_bytes = 64;
+static const size_t frame_classes = 64;
+static const size_t frame_cache_limit = 256;
+static std::vector<void *> frame_cache[frame_classes];
+static size_t frame_cache_low[frame_classes];
+
+// Buffer pools (see gc_buffer_pool_create).  Each owns one page aligned
+// mapping that is never released, carved into equal buffers.  Buffers are
+// blocks like any other, but sweeping one puts it back on its pool's free
+// list instead of freeing it.
+struct gc_buffer_pool {
+  char *base;
+  size_t buffer_size;
+  size_t count;
+  std::vector<void *> free_buffers;
+  std::vector<struct iovec> iovecs;
+};
+static std::vector<gc_buffer_pool *> buffer_pools;
+
+// Pacing.  Rather than waiting for the heap to run out, gc_alloc starts a
+// collection once the heap grows past trigger_bytes.  After each collection
+// the pacer re-estimates the allocation rate, the mark rate and the trend
+// in the live set, and sets the next goal to the projected live set scaled
+// by the growth ratio.  Collections are stop-the-world so a cycle always
+// completes within its pause, and the trigger is normally the goal.  But a
+// collection that reclaims almost nothing (e.g. while the live set is
+// still being built) was wasted, so after each one in a row the trigger
+// backs off further past the goal, up to twice the goal, until one pays
+// off again.  Only sweeping may be spread out (see below), and gc_alloc
+// assists with it at a rate that finishes it before the heap reaches the
+// trigger.
+static const double pacer_growth_ratio = 1.0;
+static const size_t pacer_min_heap = 4 * 1024 * 1024;
+static const double pacer_smoothing = 0.5; // Weight given to the newest sample
+static const double pacer_min_reclaim = 0.1; // Share of the heap a collection must reclaim to pay off
+static const size_t pacer_max_backoffs = 16;
+
+static size_t collections = 0;
+static size_t live_bytes = 0;
+static double live_trend = 0;
+static double alloc_rate = 0;
+static double mark_rate = 0;
+static size_t futile_collections = 0;  // In a row, reclaiming under pacer_min_reclaim
+static size_t heap_goal = pacer_min_heap;
+static size_t trigger_bytes = pacer_min_heap;
+static size_t allocated_since_collect = 0;
+static uint64_t last_collect_end_ns = 0;
+static uint64_t last_pause_ns = 0;
+static __thread size_t marked_bytes = 0;
+
+// Mapped files don't count towards the heap, so they have a trigger of
+// their own: mapping past mapped_trigger_bytes starts a collection.  It is
+// set like the goal, from the mapped bytes the last collection found live.
+static size_t mapped_trigger_bytes = pacer_min_heap;
+static __thread size_t marked_mapped_bytes = 0;
+
+// Per tag accounting (see gc_alloc_tagged).  The mark counts what it finds
+// per tag, in arrays indexed by tag, and each collection of the default
+// heap publishes the counts in tag_stats and checks them against budgets.
+static const size_t tag_count = 256;
+static __thread size_t marked_tag_bytes[tag_count];
+static __thread size_t marked_tag_objects[tag_count];
+static gc_tag_stats tag_stats[tag_count];
+static gc_tag_budget_callback tag_callbacks[tag_count];
+static void *tag_callback_contexts[tag_count];
+
+/**
+ *  Zeroes what gc_collect_scan_block counts, before every mark that uses
+ *  it, whichever heap it's marking.
+ */
+static void gc_reset_mark_counts(void) {
+  marked_bytes = 0;
+  marked_mapped_bytes = 0;
+  memset(marked_tag_bytes, 0, sizeof(marked_tag_bytes));
+  memset(marked_tag_objects, 0, sizeof(marked_tag_objects));
+}
+
+// Incremental sweeping.  When a collection would otherwise blow the pause
+// goal, the previous allocations map is kept here and swept a slice at a
+// time from gc_alloc, with sweep_cursor marking our progress through it.
+static uint64_t pause_goal_ns = 0;
+static heapmap *unswept = 0;
+static heapmap::iterator sweep_cursor;
+static size_t unswept_bytes = 0;
+static double sweep_rate = 0;
+static double sweep_debt = 0;
+static double assist_ratio = 0;
+
+// Allocation regions.  Blocks allocated between gc_region_begin and
+// gc_region_end are also tracked here so that gc_region_end can find which
+// of them escaped the region and reclaim the rest without a full collection.
+static int region_depth = 0;
+static heapmap *region_blocks = 0;
+static size_t region_bytes = 0;
+static gc_range *region_range;
+
+// Verify mode.  Every collection (and region end) is checked against a
+// simple reference mark over a snapshot of the same roots.
+static bool verify_heap = false;
+static std::vector<void *> verify_roots;
+
+// Live-object census.  When enabled, every block records the index of its
+// allocating call site in census_sites, and each collection counts the
+// live blocks and bytes per site into census, remembering the previous
+// collection's counts in census_previous for the deltas.
+static bool census_enabled = false;
+static std::vector<void *> census_sites(1);
+static std::unordered_map<void *, uint32_t> census_site_index;
+static std::vector<gc_site_census> census;
+static std::vector<gc_site_census> census_previous;
+
+// Trace recording (see gc_trace.h for the format)
+static FILE *trace_file = 0;
+static uint64_t trace_start_ns;
+
+// Idle sweeping checks the clock every slice of roughly this long
+static const uint64_t idle_slice_ns = 50 * 1000;
+static const size_t idle_min_slice_bytes = 64 * 1024;
+
+// Recent pauses (collections and sweep slices) for reporting percentiles
+static const size_t pause_history_size = 1024;
+static uint64_t pause_history[pause_history_size];
+static size_t pause_count = 0;
+static uint64_t total_pause_ns = 0;
 
 // Debugging constant to control whether we log verbosely during collections
 static bool verbose_logging = false;
@@ -57,6 +355,17 @@ static bool verbose_logging = false;
 static bool overwrite_reclaimed_blocks = false;
 
 
+/**
+ *  Page faults the process has taken so far
+ */
+static long gc_page_faults(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage)) {
+    return 0;
+  }
+  return usage.ru_minflt + usage.ru_majflt;
+}
+
 /**
  *  The main job of gc_init is to establish the "root set" used
  *  for our mark/sweep process.  We need to scan the live part
@@ -67,13 +376,39 @@ static bool overwrite_reclaimed_blocks = false;
 static void gc_init(void) {
   static bool gc_initialized = false;
   
+  if (!stack_start) {
+    gc_init_thread_stack();
+  }
+  
   if (gc_initialized) {
     return;
   }
   gc_initialized = true;
-
-  // Find where the stack starts/ends
   
+  // Find where the data segment starts/ends
+  
+  // NOTE Release builds have data segments "slid" by a random amount
+  // to prevent buffer overflow attacks (google ASLR randomization).
+  // So the actual location of the data segment is that reported
+  // in the segment->vmaddr + the "slide" of the image.
+  
+  const struct segment_command_64 *dataSeg = getsegbyname("__DATA");
+  data_segment_start = (void **)(dataSeg->vmaddr + _dyld_get_image_vmaddr_slide(0));
+  data_segment_length = dataSeg->vmsize;
+  
+  allocations = new heapmap;
+  heap_range = new gc_range { (void *)UINTPTR_MAX, 0 };
+  region_range = new gc_range { (void *)UINTPTR_MAX, 0 };
+  last_collect_end_ns = now_ns();
+  page_faults_at_init = gc_page_faults();
+  
+  debug_printf("GC Data:  %p %lld\n", data_segment_start, data_segment_length);
+}
+
+/**
+ *  Finds where the calling thread's stack starts/ends
+ */
+static void gc_init_thread_stack(void) {
   uint64_t rsp = get_stack_pointer();
 
   mach_msg_type_number_t info_cnt = sizeof (vm_region_basic_info_data_64_t);
@@ -91,21 +426,36 @@ static void gc_init(void) {
   stack_start = (void **)address_info;
   stack_length = size_info;
   
-  // Find where the data segment starts/ends
-  
-  // NOTE Release builds have data segments "slid" by a random amount
-  // to prevent buffer overflow attacks (google ASLR randomization).
-  // So the actual location of the data segment is that reported
-  // in the segment->vmaddr + the "slide" of the image.
-  
-  const struct segment_command_64 *dataSeg = getsegbyname("__DATA");
-  data_segment_start = (void **)(dataSeg->vmaddr + _dyld_get_image_vmaddr_slide(0));
-  data_segment_length = dataSeg->vmsize;
-  
-  allocations = new heapmap;
-  
   debug_printf("GC Stack: %p %lld\n", stack_start, stack_length);
-  debug_printf("GC Data:  %p %lld\n", data_segment_start, data_segment_length);
+}
+
+static bool gc_reserve_owns(void *ptr) {
+  return reserve && ptr >= reserve->base && ptr < reserve->base + reserve->size;
+}
+
+/**
+ *  Carves a zeroed block from the reserve, preferring a reclaimed block of
+ *  the same size.  Returns 0 once the reserve is used up.
+ */
+static void *gc_reserve_alloc(size_t size) {
+  size_t rounded = gc_reserve_round(size);
+  auto free_list = reserve->free_blocks.find(rounded);
+  if (free_list != reserve->free_blocks.end() && !free_list->second.empty()) {
+    void *ptr = free_list->second.back();
+    free_list->second.pop_back();
+    memset(ptr, 0, rounded);
+    return ptr;
+  }
+  if (reserve->size - reserve->used < rounded) {
+    return 0;
+  }
+  void *ptr = reserve->base + reserve->used;
+  reserve->used += rounded;
+  return ptr;
+}
+
+static void gc_reserve_release(void *ptr, size_t size) {
+  reserve->free_blocks[gc_reserve_round(size)].push_back(ptr);
 }
 
 void *internal_alloc(size_t size) {
@@ -113,132 +463,1728 @@ void *internal_alloc(size_t size) {
   if (max_heap_size > 0 && current_allocated + size > max_heap_size) {
     return 0;
   }
+  if (reserve) {
+    void *ptr = gc_reserve_alloc(size);
+    if (ptr) {
+      return ptr;
+    }
+  }
   return calloc(1, size);
 }
 
-void *gc_alloc(size_t size) {
+/**
+ *  Folds an allocating call site's return address into a 32 bit id
+ */
+static uint32_t gc_site_id(void *return_address) {
+  uint64_t hash = (uint64_t)return_address * 0x9e3779b97f4a7c15ULL;
+  return (uint32_t)(hash >> 32);
+}
+
+/**
+ *  Finds (or adds) the census_sites index of an allocating call site
+ */
+static uint32_t gc_census_site(void *return_address) {
+  auto site = census_site_index.find(return_address);
+  if (site != census_site_index.end()) {
+    return site->second;
+  }
+  uint32_t index = (uint32_t)census_sites.size();
+  census_sites.push_back(return_address);
+  census_site_index[return_address] = index;
+  return index;
+}
+
+/**
+ *  Finds the block of heap (whose blocks all lie within [min, max]) that
+ *  word refers to.  The word is looked up as it is first, so untagged
+ *  pointers, e.g. those from gc_mark_precise, are never decoded, and only
+ *  if that misses is it decoded with pointer_mask and looked up again.
+ */
+static inline heapmap::iterator gc_find_block(heapmap *heap, void *word, void *min, void *max) {
+  if (word >= min && word <= max) {
+    auto block = heap->find(word);
+    if (block != heap->end() || pointer_mask == UINT64_MAX) {
+      return block;
+    }
+  }
+  void *decoded = (void *)((uint64_t)word & pointer_mask);
+  if (decoded == word || decoded < min || decoded > max) {
+    return heap->end();
+  }
+  return heap->find(decoded);
+}
+
+/**
+ *  Adds a newly allocated block to the heap (and region, if any)
+ */
+static void gc_track_block(void *ptr, size_t size, void *site, uint8_t flags, uint8_t tag, uint16_t tracer) {
+  gc_block block = { size, census_enabled ? gc_census_site(site) : 0, flags, tag, tracer };
+  (*allocations)[(void**)ptr] = block;
+  current_allocated += size;
+  heap_range->min = std::min(heap_range->min, ptr);
+  heap_range->max = std::max(heap_range->max, ptr);
+  if (region_depth > 0) {
+    (*region_blocks)[ptr] = block;
+    region_bytes += size;
+    region_range->min = std::min(region_range->min, ptr);
+    region_range->max = std::max(region_range->max, ptr);
+  }
+  else {
+    allocated_since_collect += size;
+  }
+  if (trace_file) {
+    uint8_t trace_flags = region_depth > 0 ? GC_TRACE_IN_REGION : 0;
+    trace_flags |= flags & GC_BLOCK_ATOMIC ? GC_TRACE_ATOMIC : 0;
+    trace_flags |= flags & GC_BLOCK_FRAME ? GC_TRACE_FRAME : 0;
+    trace_flags |= tracer ? GC_TRACE_TRACED : 0;
+    gc_trace(GC_TRACE_ALLOC, trace_flags, gc_site_id(site), ptr, size, tag);
+  }
+}
+
+/**
+ *  Gets the memory for a gc_alloc_at block: from cache if it is given and
+ *  has a block (a frame cache), otherwise from the reserve or calloc.
+ *  Either way the block has to fit under the heap limit.
+ */
+static void *gc_take_block(size_t size, std::vector<void *> *cache) {
+  if (!cache || cache->empty()) {
+    return internal_alloc(size);
+  }
+  if (max_heap_size > 0 && current_allocated + size > max_heap_size) {
+    return 0;
+  }
+  void *ptr = cache->back();
+  cache->pop_back();
+  size_t frame_class = cache - frame_cache;
+  frame_cache_low[frame_class] = std::min(frame_cache_low[frame_class], cache->size());
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+static void *gc_alloc_at(size_t size, void *site, uint8_t flags, uint8_t tag, uint16_t tracer, std::vector<void *> *cache) {
+  // Thread heaps only have plain blocks, so frames (which need the frame
+  // cache), traced and tagged blocks are shared
+  if (thread_heap && !flags && !tracer && !tag) {
+    return gc_heap_alloc(thread_heap, size);
+  }
   gc_init();
   
-  void *ptr = internal_alloc(size);
-  if (!ptr) {
-    gc_collect();
-    ptr = internal_alloc(size);
+  // Blocks may be carved from the reserve at the granule, so charge (and
+  // later reclaim) them at that size, wherever they end up coming from
+  if (reserve) {
+    size = gc_reserve_round(size);
+  }
+  
+  if (unswept) {
+    gc_sweep_assist(size);
+  }
+  
+  // Region blocks are reclaimed by gc_region_end, so don't let them drive collections
+  bool collected = false;
+  if (current_allocated - region_bytes + size > trigger_bytes) {
+    gc_collect_within(pause_goal_ns, true, GC_TRACE_TRIGGER_PACER);
+    collected = true;
+  }
+  
+  void *ptr = gc_take_block(size, cache);
+  if (!ptr && unswept) {
+    // Cheaper than a collection, reclaim the garbage we already know about
+    gc_sweep_step(SIZE_MAX);
+    ptr = gc_take_block(size, cache);
+  }
+  if (!ptr && !collected) {
+    gc_collect_within(pause_goal_ns, true, GC_TRACE_TRIGGER_HEAP_FULL);
+    ptr = gc_take_block(size, cache);
   }
   
   if (ptr) {
-    (*allocations)[(void**)ptr] = size;
-    current_allocated += size;
+    gc_track_block(ptr, size, site, flags, tag, tracer);
   }
   return ptr;
 }
 
-static void gc_collect_scan_block(void *start, size_t length, heapmap *marked) {
-  // We scan the block assumming all pointers are pointer (8 byte) aligned.
-
-  void **end = (void **)(((uint64_t)start) + length);
-  for (void** p = (void **)start; p < end; p++) {
-    // Check if this looks like a pointer that we've allocated
-    auto is_valid_allocation = allocations->find((void **)*p);
-    if (is_valid_allocation != allocations->end()) {
-      // We have a valid allocation, scan this block
+void *gc_alloc(size_t size) {
+  return gc_alloc_at(size, __builtin_return_address(0), 0, 0, 0, 0);
+}
 
-      debug_printf("GC Valid block at %p (@%p) (%lld bytes)\n", is_valid_allocation->first, p, is_valid_allocation->second);
+static double pacer_smooth(double previous, double sample, bool first_sample) {
+  if (first_sample) {
+    return sample;
+  }
+  return previous + pacer_smoothing * (sample - previous);
+}
 
-      auto has_visited = marked->find((void **)*p);
-      if (has_visited == marked->end()) {
-        
-        debug_printf("GC Valid, unmarked block at %p (@%p) (%lld bytes)\n", is_valid_allocation->first, p, is_valid_allocation->second);
-        
-        // We haven't visited this block yet, so lets "mark" it and
-        // recursively scan its ocntent;s
-        marked->insert(*is_valid_allocation);
-        gc_collect_scan_block(is_valid_allocation->first, is_valid_allocation->second, marked);
-      }
+/**
+ *  Sets the goal (and thus trigger) for the next collection.  The goal is
+ *  where the live set is heading, per its trend, scaled by the growth ratio,
+ *  but never below pacer_min_heap nor above the max heap size.
+ */
+static void pacer_update_goal(void) {
+  double projected_live = live_bytes + live_trend;
+  if (projected_live < live_bytes) {
+    // Don't plan for the live set to shrink, it rarely does so smoothly
+    projected_live = live_bytes;
+  }
+  
+  size_t goal = (size_t)(projected_live * (1 + pacer_growth_ratio));
+  if (goal < pacer_min_heap) {
+    goal = pacer_min_heap;
+  }
+  if (max_heap_size > 0 && goal > max_heap_size) {
+    goal = max_heap_size;
+  }
+  
+  heap_goal = goal;
+  trigger_bytes = goal;
+  if (futile_collections > 0) {
+    trigger_bytes += std::min(goal, pacer_min_heap << (futile_collections - 1));
+    if (max_heap_size > 0 && trigger_bytes > max_heap_size) {
+      trigger_bytes = max_heap_size;
     }
   }
 }
 
 /**
- * Implements a simple conservative mark and sweep over the set of blocks stored in
- * the allocations map.  We start the trace from the root set which is made up of three
- * sets: registers, active stack, and data segment.  We scan each of those areas for
- * anything that matches a block in our allocations map.  If found we "mark" that block
- * by adding it to the "marked" map, and then we recursively scan that block.
+ *  Feeds the measurements of a just completed collection into the pacer.
+ *  start_ns/mark_ns describe the collection, the allocation rate is taken
+ *  over the mutator time since the previous one ended.
  */
-void gc_collect(void) {
-  gc_init();
+static void pacer_collection_done(size_t heap_bytes, size_t marked, uint64_t start_ns, uint64_t mark_ns, uint64_t end_ns) {
+  size_t previous_live = live_bytes;
+  bool first_sample = collections == 0;
   
-  // Mark
-  debug_printf("GC START\n");
+  collections++;
+  live_bytes = marked;
+  if (heap_bytes - std::min(heap_bytes, marked) < heap_bytes * pacer_min_reclaim) {
+    futile_collections = std::min(futile_collections + 1, pacer_max_backoffs);
+  }
+  else {
+    futile_collections = 0;
+  }
+  last_pause_ns = end_ns - start_ns;
   
-  heapmap *marked = new heapmap;
-
-  // Make sure all the registers get reified onto the stack so if they
-  // are pointing to any memory we get them.
-  debug_printf("GC Marking registers\n");
-  void **registers = (void **)calloc(sizeof(void *), 15);
-  get_registers(registers);
-  gc_collect_scan_block(registers, sizeof(void *) * 15, marked);
-  free(registers);
+  if (start_ns > last_collect_end_ns) {
+    alloc_rate = pacer_smooth(alloc_rate, allocated_since_collect * 1e9 / (start_ns - last_collect_end_ns), first_sample);
+  }
+  if (mark_ns > 0) {
+    mark_rate = pacer_smooth(mark_rate, live_bytes * 1e9 / mark_ns, first_sample);
+  }
+  live_trend = pacer_smooth(live_trend, (double)live_bytes - (double)previous_live, first_sample);
+  
+  allocated_since_collect = 0;
+  last_collect_end_ns = end_ns;
+  
+  pacer_update_goal();
+  
+  debug_printf("GC Pacer: live %zu, trend %.0f, alloc %.0f B/s, mark %.0f B/s, goal %zu\n",
+               live_bytes, live_trend, alloc_rate, mark_rate, heap_goal);
+}
 
-  debug_printf("GC Marking stack\n");
-  uint64_t curr_stack = get_stack_pointer();
-  // We don't scan the entire stack, just the part in use.
-  gc_collect_scan_block((void **)curr_stack, (size_t)((int64_t)stack_start + stack_length - curr_stack), marked);
+/**
+ *  Frees a block that is no longer in the allocations map.
+ */
+static void gc_reclaim_block(void *ptr, const gc_block &block, uint8_t reason) {
+  size_t size = block.size;
+  debug_printf("GC Sweeping %p (%lld bytes)\n", ptr, size);
   
-  debug_printf("GC Marking data segment\n");
-  gc_collect_scan_block(data_segment_start, data_segment_length, marked);
+  if (block.flags & GC_BLOCK_MAPPED) {
+    munmap(ptr, size);
+    mapped_bytes -= size;
+    return;
+  }
   
-  // Sweep - free everything in allocations that has not been "marked" (is not in the marked map)
-  debug_printf("GC Sweeping garbage\n");
-  size_t total_swept = 0;
-  for (const auto &allocation : *allocations) {
-    if (marked->find(allocation.first) == marked->end()) {
-      
-      debug_printf("GC Sweeping %p (%lld bytes)\n", allocation.first, allocation.second);
-      
-      // For debugging
-      if (overwrite_reclaimed_blocks) {
-        memset(allocation.first, 0xab, allocation.second);
+  if (block.flags & GC_BLOCK_POOLED) {
+    if (overwrite_reclaimed_blocks) {
+      memset(ptr, 0xab, size);
+    }
+    for (gc_buffer_pool *pool : buffer_pools) {
+      if (ptr >= pool->base && ptr < pool->base + pool->buffer_size * pool->count) {
+        pool->free_buffers.push_back(ptr);
+        break;
       }
-      
-      free(allocation.first);
-      total_swept += allocation.second;
     }
+    return;
   }
   
-  current_allocated -= total_swept;
+  if (trace_file) {
+    gc_trace(GC_TRACE_FREE, reason, 0, ptr, size, 0);
+  }
   
-  debug_printf("GC Swept %lld bytes\n", total_swept);
+  // For debugging
+  if (overwrite_reclaimed_blocks) {
+    memset(ptr, 0xab, size);
+  }
   
-  delete allocations;
-  allocations = marked;
+  if (region_blocks && region_blocks->erase(ptr)) {
+    region_bytes -= size;
+  }
   
-  debug_printf("GC DONE\n");
+  std::vector<void *> *cache = 0;
+  if (block.flags & GC_BLOCK_FRAME) {
+    cache = &frame_cache[size / frame_class_bytes - 1];
+  }
+  if (cache && cache->size() < frame_cache_limit) {
+    cache->push_back(ptr);
+  }
+  else if (gc_reserve_owns(ptr)) {
+    gc_reserve_release(ptr, size);
+  }
+  else {
+    free(ptr);
+  }
+  current_allocated -= size;
 }
 
-void gc_debug_set_max_heap(size_t size) {
-  max_heap_size = size;
+/**
+ *  Frees the cached frames that weren't needed since the last collection,
+ *  the oldest ones at the front of each list.
+ */
+static void gc_trim_frame_caches(void) {
+  for (size_t frame_class = 0; frame_class < frame_classes; frame_class++) {
+    std::vector<void *> &cache = frame_cache[frame_class];
+    size_t idle = std::min(frame_cache_low[frame_class], cache.size());
+    for (size_t i = 0; i < idle; i++) {
+      if (gc_reserve_owns(cache[i])) {
+        gc_reserve_release(cache[i], (frame_class + 1) * frame_class_bytes);
+      }
+      else {
+        free(cache[i]);
+      }
+    }
+    cache.erase(cache.begin(), cache.begin() + idle);
+    frame_cache_low[frame_class] = cache.size();
+  }
 }
 
-void gc_debug_enable_verbose_logging(bool flag) {
-  verbose_logging = flag;
+static void gc_record_pause(uint64_t pause_ns) {
+  total_pause_ns += pause_ns;
+  pause_history[pause_count % pause_history_size] = pause_ns;
+  pause_count++;
 }
 
-void gc_debug_overwrite_reclaimed_blocks(bool flag) {
-  overwrite_reclaimed_blocks = flag;
+/**
+ *  Sweeps at least budget_bytes worth of the unswept map (or all of it),
+ *  freeing any block that didn't make it into the new allocations map.
+ *  Returns true once there is nothing left to sweep.
+ */
+static bool gc_sweep_step(size_t budget_bytes) {
+  if (!unswept) {
+    return true;
+  }
+  
+  uint64_t start_ns = now_ns();
+  size_t examined = 0;
+  size_t swept = 0;
+  while (sweep_cursor != unswept->end() && examined < budget_bytes) {
+    if (allocations->find(sweep_cursor->first) == allocations->end()) {
+      gc_reclaim_block(sweep_cursor->first, sweep_cursor->second, GC_TRACE_FREE_SWEPT);
+      swept += gc_block_heap_bytes(sweep_cursor->second);
+    }
+    examined += gc_block_heap_bytes(sweep_cursor->second);
+    ++sweep_cursor;
+  }
+  
+  unswept_bytes -= examined;
+  
+  uint64_t elapsed_ns = now_ns() - start_ns;
+  if (elapsed_ns > 0) {
+    sweep_rate = pacer_smooth(sweep_rate, examined * 1e9 / elapsed_ns, sweep_rate == 0);
+  }
+  
+  debug_printf("GC Swept %lld bytes\n", swept);
+  
+  if (sweep_cursor != unswept->end()) {
+    return false;
+  }
+  delete unswept;
+  unswept = 0;
+  unswept_bytes = 0;
+  sweep_debt = 0;
+  return true;
 }
 
-static void debug_printf(const char *format, ...) {
-  if (!verbose_logging) {
+/**
+ *  Called from gc_alloc while a lazy sweep is pending.  The mutator pays
+ *  for the sweep in proportion to what it allocates, at a ratio that
+ *  finishes the sweep before the heap reaches the next trigger.  The work
+ *  is batched into slices sized to fit within the pause goal.
+ */
+static void gc_sweep_assist(size_t size) {
+  size_t headroom = trigger_bytes > current_allocated ? trigger_bytes - current_allocated : 1;
+  assist_ratio = (double)unswept_bytes / headroom;
+  sweep_debt += size * assist_ratio;
+  
+  size_t slice_bytes = (size_t)(sweep_rate * pause_goal_ns / 1e9 / 2);
+  if (sweep_debt < slice_bytes && size < headroom) {
     return;
   }
-  va_list args;
-  va_start (args, format);
-  vprintf (format, args);
-  va_end (args);
+  
+  uint64_t start_ns = now_ns();
+  size_t budget = (size_t)sweep_debt;
+  sweep_debt = 0;
+  gc_sweep_step(budget);
+  gc_record_pause(now_ns() - start_ns);
 }
 
+/**
+ *  Hands the calling thread's roots to visit: its registers and the active
+ *  part of its stack.
+ */
+template <typename Scan>
+static void gc_scan_thread_roots(Scan visit) {
+  if (precise_roots) {
+    debug_printf("GC Marking %zu precise roots\n", shadow_depth);
+    for (size_t i = 0; i < shadow_depth; i++) {
+      visit(shadow_stack[i], sizeof(void *));
+    }
+    return;
+  }
+  
+  // Make sure all the registers get reified onto the stack so if they
+  // are pointing to any memory we get them.
+  debug_printf("GC Marking registers\n");
+  void **registers = (void **)calloc(sizeof(void *), 15);
+  get_registers(registers);
+  visit(registers, sizeof(void *) * 15);
+  free(registers);
+
+  debug_printf("GC Marking stack\n");
+  uint64_t curr_stack = get_stack_pointer();
+  uint64_t stack_end = current_stack ? (uint64_t)current_stack->base + current_stack->size : (uint64_t)stack_start + stack_length;
+  // We don't scan the entire stack, just the part in use.
+  visit((void **)curr_stack, (size_t)(stack_end - curr_stack));
+}
+
+/**
+ *  Collects the hits of a suspended stack, i.e. the words in its live part
+ *  that point at a block of the default heap.
+ */
+static void gc_stack_find_hits(gc_stack *stack) {
+  stack->hits.clear();
+  void **end = (void **)((uint64_t)stack->base + stack->size);
+  for (void **p = (void **)stack->saved_sp; p < end; p++) {
+    if (gc_find_block(allocations, *p, heap_range->min, heap_range->max) != allocations->end()) {
+      stack->hits.push_back(*p);
+    }
+  }
+}
+
+/**
+ *  Hands the suspended fiber stacks to visit.  With use_hits, stacks are
+ *  reduced to their hits in the default heap (rescanning only the dirty
+ *  ones, in parallel if there's enough to scan) and visit gets the hits.
+ *  Otherwise, e.g. for other heaps, it gets the stacks' live parts.  In
+ *  verify mode the live parts are copied into verify_roots either way, so
+ *  the reference mark doesn't depend on the cached hits.
+ */
+template <typename Scan>
+static void gc_scan_fiber_stacks(bool use_hits, Scan visit) {
+  std::lock_guard<std::mutex> guard(fiber_stacks_lock);
+  if (fiber_stacks.empty()) {
+    return;
+  }
+  
+  std::vector<gc_stack *> suspended;
+  for (gc_stack *stack : fiber_stacks) {
+    if (stack->saved_sp) {
+      suspended.push_back(stack);
+    }
+  }
+  debug_printf("GC Marking %zu suspended stacks\n", suspended.size());
+  
+  if (verify_heap) {
+    for (gc_stack *stack : suspended) {
+      verify_roots.insert(verify_roots.end(), (void **)stack->saved_sp, (void **)((uint64_t)stack->base + stack->size));
+    }
+  }
+  
+  if (!use_hits) {
+    for (gc_stack *stack : suspended) {
+      visit(stack->saved_sp, (uint64_t)stack->base + stack->size - (uint64_t)stack->saved_sp);
+    }
+    return;
+  }
+  
+  std::vector<gc_stack *> dirty;
+  size_t dirty_bytes = 0;
+  for (gc_stack *stack : suspended) {
+    if (stack->dirty) {
+      dirty.push_back(stack);
+      dirty_bytes += (uint64_t)stack->base + stack->size - (uint64_t)stack->saved_sp;
+    }
+  }
+  stacks_scanned = dirty.size();
+  stacks_cached = suspended.size() - dirty.size();
+  
+  // Finding hits only reads the heap, so workers can split the stacks
+  size_t workers = std::min((size_t)std::thread::hardware_concurrency(), dirty.size());
+  if (workers > 1 && dirty_bytes >= parallel_scan_min_bytes) {
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < workers; w++) {
+      threads.push_back(std::thread([&dirty, w, workers]() {
+        for (size_t i = w; i < dirty.size(); i += workers) {
+          gc_stack_find_hits(dirty[i]);
+        }
+      }));
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+  }
+  else {
+    for (gc_stack *stack : dirty) {
+      gc_stack_find_hits(stack);
+    }
+  }
+  
+  for (gc_stack *stack : suspended) {
+    stack->dirty = false;
+    if (!stack->hits.empty()) {
+      visit(stack->hits.data(), stack->hits.size() * sizeof(void *));
+    }
+  }
+}
+
+/**
+ *  Runs the root callbacks, each with its own gc_mark_ctx and in parallel
+ *  if there are several, the cores to run them and enough work, then hands
+ *  what they reported to visit.
+ */
+template <typename Scan>
+static void gc_scan_root_callbacks(Scan visit) {
+  if (root_callbacks.empty()) {
+    return;
+  }
+  debug_printf("GC Running %zu root callbacks\n", root_callbacks.size());
+  
+  uint64_t start_ns = now_ns();
+  std::vector<gc_mark_ctx> contexts(root_callbacks.size());
+  size_t workers = std::min((size_t)std::thread::hardware_concurrency(), root_callbacks.size());
+  if (workers > 1 && root_callbacks_ns >= parallel_callbacks_min_ns) {
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < workers; w++) {
+      threads.push_back(std::thread([&contexts, w, workers]() {
+        for (size_t i = w; i < root_callbacks.size(); i += workers) {
+          root_callbacks[i].first(&contexts[i], root_callbacks[i].second);
+        }
+      }));
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+  }
+  else {
+    for (size_t i = 0; i < root_callbacks.size(); i++) {
+      root_callbacks[i].first(&contexts[i], root_callbacks[i].second);
+    }
+  }
+  root_callbacks_ns = now_ns() - start_ns;
+  
+  for (const gc_mark_ctx &context : contexts) {
+    if (!context.pointers.empty()) {
+      visit((void *)context.pointers.data(), context.pointers.size() * sizeof(void *));
+    }
+    for (const auto &range : context.ranges) {
+      visit(range.first, range.second);
+    }
+  }
+}
+
+/**
+ *  Hands each part of the root set to scan: registers, the active part of
+ *  the stack, suspended fiber stacks, the data segment, the declared roots
+ *  and the root callbacks.  In verify mode the contents are also copied
+ *  into verify_roots so the reference mark sees exactly the same roots,
+ *  even though the stack and registers change as we go.
+ */
+template <typename Scan>
+static void gc_scan_roots(const rootlist &declared, bool use_stack_hits, Scan scan) {
+  verify_roots.clear();
+  auto visit = [&scan](void *start, size_t length) {
+    if (verify_heap) {
+      verify_roots.insert(verify_roots.end(), (void **)start, (void **)start + length / sizeof(void *));
+    }
+    scan(start, length);
+  };
+  
+  gc_scan_thread_roots(visit);
+  gc_scan_fiber_stacks(use_stack_hits, scan);
+  
+  debug_printf("GC Marking data segment\n");
+  visit(data_segment_start, data_segment_length);
+  
+  if (!declared.empty()) {
+    debug_printf("GC Marking %zu declared roots\n", declared.size());
+  }
+  for (const auto &root : declared) {
+    visit(root.first, root.second);
+  }
+  
+  gc_scan_root_callbacks(visit);
+}
+
+/**
+ *  Hands every block of every gc_thread_heap to scan.  They may point into
+ *  the shared heap, but only their own thread tracks what points to them.
+ *  Called after gc_scan_roots, and like it adds what it scans to
+ *  verify_roots in verify mode.
+ */
+template <typename Scan>
+static void gc_scan_thread_heaps(Scan scan) {
+  std::lock_guard<std::mutex> guard(thread_heaps_lock);
+  for (gc_heap *heap : thread_heaps) {
+    std::lock_guard<std::mutex> heap_guard(heap->lock);
+    for (const auto &block : *heap->allocations) {
+      if (verify_heap) {
+        verify_roots.insert(verify_roots.end(), (void **)block.first, (void **)block.first + block.second.size / sizeof(void *));
+      }
+      scan(block.first, block.second.size);
+    }
+  }
+}
+
+/**
+ *  Hands the references a block holds to scan: nothing for an atomic block,
+ *  what its trace function reports for a gc_alloc_traced block, and
+ *  otherwise all of its words.
+ */
+template <typename Scan>
+static void gc_scan_block_contents(void *ptr, const gc_block &block, Scan scan) {
+  if (block.flags & GC_BLOCK_ATOMIC) {
+    return;
+  }
+  if (!block.tracer) {
+    scan(ptr, block.size);
+    return;
+  }
+  gc_mark_ctx mark;
+  tracers[block.tracer](ptr, &mark);
+  if (!mark.pointers.empty()) {
+    scan((void *)mark.pointers.data(), mark.pointers.size() * sizeof(void *));
+  }
+  for (const auto &range : mark.ranges) {
+    scan(range.first, range.second);
+  }
+}
+
+/**
+ *  The reference mark used by verify mode, deliberately sharing none of the
+ *  collector's scanning code.  Every word of verify_roots, and of every
+ *  reached block that isn't atomic, is looked up in heap as it is and
+ *  then decoded.  For traced blocks the words are the ones their trace
+ *  function reports.  Returns the reachable set.
+ */
+static heapmap *gc_verify_reference_mark(heapmap *heap) {
+  heapmap *reachable = new heapmap;
+  std::vector<std::pair<void *, gc_block>> pending;
+  auto reach = [heap, reachable, &pending](void *word) {
+    auto block = heap->find(word);
+    if (block == heap->end()) {
+      block = heap->find((void *)((uint64_t)word & pointer_mask));
+    }
+    if (block != heap->end() && reachable->insert(*block).second) {
+      pending.push_back(*block);
+    }
+  };
+  
+  for (void *word : verify_roots) {
+    reach(word);
+  }
+  while (!pending.empty()) {
+    std::pair<void *, gc_block> block = pending.back();
+    pending.pop_back();
+    if (block.second.flags & GC_BLOCK_ATOMIC) {
+      continue;
+    }
+    rootlist ranges(1, std::make_pair(block.first, block.second.size));
+    if (block.second.tracer) {
+      gc_mark_ctx mark;
+      tracers[block.second.tracer](block.first, &mark);
+      for (void *word : mark.pointers) {
+        reach(word);
+      }
+      ranges.swap(mark.ranges);
+    }
+    for (const auto &range : ranges) {
+      void **words = (void **)range.first;
+      for (size_t i = 0; i < range.second / sizeof(void *); i++) {
+        reach(words[i]);
+      }
+    }
+  }
+  return reachable;
+}
+
+/**
+ *  Checks that none of the blocks in doomed (about to be freed) are
+ *  reachable according to the reference mark over heap.  Reports every
+ *  such block and aborts if there are any.
+ */
+template <typename Doomed>
+static void gc_verify(heapmap *heap, Doomed doomed, const char *phase) {
+  heapmap *reachable = gc_verify_reference_mark(heap);
+  size_t missed = 0;
+  for (const auto &block : *reachable) {
+    if (doomed(block.first)) {
+      fprintf(stderr, "GC Verify: %s would free reachable block %p (%zu bytes)\n", phase, block.first, block.second.size);
+      missed++;
+    }
+  }
+  delete reachable;
+  
+  if (missed > 0) {
+    fprintf(stderr, "GC Verify: %zu reachable blocks missed, aborting\n", missed);
+    abort();
+  }
+  debug_printf("GC Verify: %s ok\n", phase);
+}
+
+/**
+ *  Marks every block of heap (whose blocks all lie within [min, max]) that
+ *  [start, start + length) points to, and recursively what they point to.
+ */
+static void gc_collect_scan_block(void *start, size_t length, heapmap *heap, void *min, void *max, heapmap *marked) {
+  // We scan the block assumming all pointers are pointer (8 byte) aligned.
+
+  void **end = (void **)(((uint64_t)start) + length);
+  for (void** p = (void **)start; p < end; p++) {
+    // Check if this looks like a pointer that we've allocated.  The range
+    // check comes first, most words don't point anywhere near the heap
+    auto is_valid_allocation = gc_find_block(heap, *p, min, max);
+    if (is_valid_allocation != heap->end()) {
+      // We have a valid allocation, scan this block
+
+      debug_printf("GC Valid block at %p (@%p) (%lld bytes)\n", is_valid_allocation->first, p, is_valid_allocation->second.size);
+
+      auto has_visited = marked->find(is_valid_allocation->first);
+      if (has_visited == marked->end()) {
+        
+        debug_printf("GC Valid, unmarked block at %p (@%p) (%lld bytes)\n", is_valid_allocation->first, p, is_valid_allocation->second.size);
+        
+        // We haven't visited this block yet, so lets "mark" it and
+        // recursively scan its ocntent;s
+        marked->insert(*is_valid_allocation);
+        marked_bytes += gc_block_heap_bytes(is_valid_allocation->second);
+        if (is_valid_allocation->second.flags & GC_BLOCK_MAPPED) {
+          marked_mapped_bytes += is_valid_allocation->second.size;
+        }
+        marked_tag_bytes[is_valid_allocation->second.tag] += is_valid_allocation->second.size;
+        marked_tag_objects[is_valid_allocation->second.tag]++;
+        gc_scan_block_contents(is_valid_allocation->first, is_valid_allocation->second, [heap, min, max, marked](void *start, size_t length) {
+          gc_collect_scan_block(start, length, heap, min, max, marked);
+        });
+      }
+    }
+  }
+}
+
+/**
+ *  Counts the live blocks and bytes per allocation site in the freshly
+ *  marked allocations map, and how each site changed since last time.
+ */
+static void gc_take_census(void) {
+  census_previous.swap(census);
+  census.assign(census_sites.size(), gc_site_census());
+  for (const auto &allocation : *allocations) {
+    gc_site_census &site = census[allocation.second.site];
+    site.live_objects++;
+    site.live_bytes += allocation.second.size;
+  }
+  for (size_t i = 0; i < census.size(); i++) {
+    census[i].site = census_sites[i];
+    census[i].objects_delta = (int64_t)census[i].live_objects;
+    census[i].bytes_delta = (int64_t)census[i].live_bytes;
+    if (i < census_previous.size()) {
+      census[i].objects_delta -= (int64_t)census_previous[i].live_objects;
+      census[i].bytes_delta -= (int64_t)census_previous[i].live_bytes;
+    }
+  }
+}
+
+/**
+ *  Publishes the per tag counts of the mark that just finished, then calls
+ *  the budget callback of every tag over its budget.  The heap is
+ *  consistent by now, so callbacks may use it.
+ */
+static void gc_publish_tag_stats(void) {
+  for (size_t tag = 0; tag < tag_count; tag++) {
+    tag_stats[tag].live_bytes = marked_tag_bytes[tag];
+    tag_stats[tag].live_objects = marked_tag_objects[tag];
+  }
+  for (size_t tag = 0; tag < tag_count; tag++) {
+    if (tag_callbacks[tag] && tag_stats[tag].budget > 0 && tag_stats[tag].live_bytes > tag_stats[tag].budget) {
+      debug_printf("GC Tag %zu over budget, %zu of %zu bytes\n", tag, tag_stats[tag].live_bytes, tag_stats[tag].budget);
+      tag_callbacks[tag]((uint8_t)tag, tag_stats[tag].live_bytes, tag_stats[tag].budget, tag_callback_contexts[tag]);
+    }
+  }
+}
+
+/**
+ * Implements a simple conservative mark and sweep over the set of blocks stored in
+ * the allocations map.  We start the trace from the root set which is made up of three
+ * sets: registers, active stack, and data segment.  We scan each of those areas for
+ * anything that matches a block in our allocations map.  If found we "mark" that block
+ * by adding it to the "marked" map, and then we recursively scan that block.
+ *
+ * The sweep normally happens right away, but if budget_ns is set (e.g. the pause
+ * goal) and the sweep is predicted not to fit in what is left of it, the old map
+ * is kept as "unswept" and swept incrementally (see gc_sweep_assist).
+ */
+static void gc_collect_within(uint64_t budget_ns, bool record_pause, uint8_t trigger) {
+  uint64_t start_ns = now_ns();
+  
+  // Finish the previous cycle's sweep, marking needs a complete allocations map
+  gc_sweep_step(SIZE_MAX);
+  gc_trim_frame_caches();
+  
+  // Mark
+  debug_printf("GC START\n");
+  
+  heapmap *marked = new heapmap;
+  gc_reset_mark_counts();
+
+  gc_scan_roots(default_roots, true, [marked](void *start, size_t length) {
+    gc_collect_scan_block(start, length, allocations, heap_range->min, heap_range->max, marked);
+  });
+  gc_scan_thread_heaps([marked](void *start, size_t length) {
+    gc_collect_scan_block(start, length, allocations, heap_range->min, heap_range->max, marked);
+  });
+  
+  uint64_t mark_ns = now_ns() - start_ns;
+  mapped_trigger_bytes = std::max((size_t)(marked_mapped_bytes * (1 + pacer_growth_ratio)), pacer_min_heap);
+  
+  if (verify_heap) {
+    gc_verify(allocations, [marked](void *block) { return marked->find(block) == marked->end(); }, "collection");
+  }
+  
+  // Sweep - free everything in allocations that has not been "marked" (is not in the marked map).
+  // The marked map becomes the new allocations map and the old one is swept against it.
+  size_t heap_bytes = current_allocated;
+  unswept = allocations;
+  unswept_bytes = current_allocated;
+  sweep_cursor = unswept->begin();
+  allocations = marked;
+  
+  if (census_enabled) {
+    gc_take_census();
+  }
+  
+  bool lazy = false;
+  if (budget_ns > 0 && sweep_rate > 0) {
+    uint64_t predicted_sweep_ns = (uint64_t)(unswept_bytes * 1e9 / sweep_rate);
+    lazy = mark_ns + predicted_sweep_ns > budget_ns;
+  }
+  
+  if (lazy) {
+    debug_printf("GC Deferring sweep of %zu bytes to stay within budget\n", unswept_bytes);
+  }
+  else {
+    debug_printf("GC Sweeping garbage\n");
+    gc_sweep_step(SIZE_MAX);
+  }
+  
+  uint64_t end_ns = now_ns();
+  pacer_collection_done(heap_bytes, marked_bytes, start_ns, mark_ns, end_ns);
+  if (record_pause) {
+    gc_record_pause(end_ns - start_ns);
+  }
+  if (trace_file) {
+    gc_trace(GC_TRACE_COLLECT, trigger, 0, (void *)mark_ns, marked_bytes, 0);
+  }
+  
+  debug_printf("GC DONE\n");
+  
+  gc_publish_tag_stats();
+}
+
+void gc_collect(void) {
+  gc_init();
+  gc_collect_within(pause_goal_ns, true, GC_TRACE_TRIGGER_EXPLICIT);
+}
+
+/**
+ *  Sweeps in small slices until the sweep is done or deadline_ns passes.
+ *  Returns true if the sweep finished.
+ */
+static bool gc_sweep_until(uint64_t deadline_ns) {
+  size_t slice_bytes = std::max((size_t)(sweep_rate * idle_slice_ns / 1e9), idle_min_slice_bytes);
+  while (unswept && now_ns() < deadline_ns) {
+    gc_sweep_step(slice_bytes);
+  }
+  return !unswept;
+}
+
+/**
+ *  Uses idle time for GC work, most urgent first: a pending sweep would
+ *  otherwise be finished inside the next collection's pause, so it goes
+ *  first.  Then, if the heap has grown since the last collection and the
+ *  mark is predicted to fit, we collect, deferring whatever part of the
+ *  sweep doesn't fit and sweeping that until the deadline.
+ */
+bool gc_collect_idle(uint64_t deadline_ns) {
+  gc_init();
+  
+  bool completed = false;
+  if (unswept) {
+    completed = gc_sweep_until(deadline_ns);
+    if (!completed) {
+      return false;
+    }
+  }
+  
+  uint64_t start_ns = now_ns();
+  if (allocated_since_collect == 0 || start_ns >= deadline_ns) {
+    return completed;
+  }
+  
+  uint64_t predicted_mark_ns = mark_rate > 0 ? (uint64_t)((live_bytes + std::max(live_trend, 0.0)) * 1e9 / mark_rate) : 0;
+  if (start_ns + predicted_mark_ns > deadline_ns) {
+    debug_printf("GC Idle: %llu ns is too short for a %llu ns mark\n", deadline_ns - start_ns, predicted_mark_ns);
+    return completed;
+  }
+  
+  gc_collect_within(deadline_ns - start_ns, false, GC_TRACE_TRIGGER_IDLE);
+  return gc_sweep_until(deadline_ns);
+}
+
+void gc_region_begin(void) {
+  gc_init();
+  
+  if (region_depth++ > 0) {
+    return;
+  }
+  region_blocks = new heapmap;
+  region_bytes = 0;
+  region_range->min = (void *)UINTPTR_MAX;
+  region_range->max = 0;
+}
+
+/**
+ *  Adds any region block that the range [start, start + length) points to
+ *  to escaped, and queues it so its own contents get scanned.
+ */
+static void gc_region_scan_block(void *start, size_t length, heapmap *escaped, std::vector<void *> &pending) {
+  void **end = (void **)(((uint64_t)start) + length);
+  for (void** p = (void **)start; p < end; p++) {
+    auto block = gc_find_block(region_blocks, *p, region_range->min, region_range->max);
+    if (block != region_blocks->end() && escaped->insert(*block).second) {
+      pending.push_back(block->first);
+    }
+  }
+}
+
+/**
+ *  Without a write barrier we can't know which older blocks were modified
+ *  to point into the region, so the roots here are the usual root set plus
+ *  every block allocated outside the region.  Those are only scanned, not
+ *  traced, and each word is rejected by a range check unless it points
+ *  into the region, but the scan still touches every word of the heap, so
+ *  the cost grows with the heap rather than with the region.  Region
+ *  blocks reachable from there are traced, and escaped blocks simply stay
+ *  in the heap while the rest are freed right away.
+ */
+size_t gc_region_end(void) {
+  if (region_depth == 0 || --region_depth > 0) {
+    return 0;
+  }
+  
+  // A lazy sweep may still be due to reclaim dead region blocks, finish it
+  // so they aren't reclaimed twice.  That also leaves only live blocks here.
+  gc_sweep_step(SIZE_MAX);
+  
+  debug_printf("GC Region end, %zu bytes in %zu blocks\n", region_bytes, region_blocks->size());
+  
+  heapmap *escaped = new heapmap;
+  std::vector<void *> pending;
+  
+  auto scan = [escaped, &pending](void *start, size_t length) {
+    gc_region_scan_block(start, length, escaped, pending);
+  };
+  gc_scan_roots(default_roots, true, scan);
+  gc_scan_thread_heaps(scan);
+  for (const auto &allocation : *allocations) {
+    if (allocation.first < region_range->min || allocation.first > region_range->max || !region_blocks->count(allocation.first)) {
+      gc_scan_block_contents(allocation.first, allocation.second, scan);
+    }
+  }
+  while (!pending.empty()) {
+    void *block = pending.back();
+    pending.pop_back();
+    gc_scan_block_contents(block, (*region_blocks)[block], scan);
+  }
+  
+  if (verify_heap) {
+    gc_verify(allocations, [escaped](void *block) {
+      return region_blocks->count(block) && !escaped->count(block);
+    }, "region end");
+  }
+  
+  heapmap *region = region_blocks;
+  region_blocks = 0;
+  region_bytes = 0;
+  
+  size_t reclaimed = 0;
+  size_t promoted = 0;
+  for (const auto &block : *region) {
+    if (escaped->count(block.first)) {
+      promoted += block.second.size;
+    }
+    else {
+      allocations->erase(block.first);
+      gc_reclaim_block(block.first, block.second, GC_TRACE_FREE_REGION_END);
+      reclaimed += block.second.size;
+    }
+  }
+  
+  // Escaped blocks are now ordinary heap blocks and count towards the next collection
+  allocated_since_collect += promoted;
+  
+  debug_printf("GC Region reclaimed %zu bytes, %zu bytes escaped\n", reclaimed, promoted);
+  
+  delete region;
+  delete escaped;
+  return reclaimed;
+}
+
+gc_heap_t *gc_heap_create(size_t max_heap) {
+  gc_init();
+  
+  gc_heap *heap = new gc_heap();
+  heap->allocations = new heapmap;
+  heap->min = (void *)UINTPTR_MAX;
+  heap->max = 0;
+  heap->max_heap_size = max_heap;
+  heap->heap_goal = max_heap > 0 ? std::min(pacer_min_heap, max_heap) : pacer_min_heap;
+  
+  std::lock_guard<std::mutex> guard(heaps_lock);
+  heaps.push_back(heap);
+  return heap;
+}
+
+void gc_heap_destroy(gc_heap_t *heap) {
+  {
+    std::lock_guard<std::mutex> guard(heaps_lock);
+    heaps.erase(std::find(heaps.begin(), heaps.end(), heap));
+  }
+  if (heap->thread_local_roots) {
+    // Already unregistered if gc_thread_heap(false) got here first
+    std::lock_guard<std::mutex> guard(thread_heaps_lock);
+    auto registered = std::find(thread_heaps.begin(), thread_heaps.end(), heap);
+    if (registered != thread_heaps.end()) {
+      thread_heaps.erase(registered);
+    }
+  }
+  if (heap == thread_heap) {
+    thread_heap = 0;
+  }
+  for (const auto &allocation : *heap->allocations) {
+    free(allocation.first);
+  }
+  delete heap->allocations;
+  delete heap;
+}
+
+void *gc_heap_alloc(gc_heap_t *heap, size_t size) {
+  if (heap->current_allocated + size > heap->heap_goal) {
+    gc_heap_collect(heap);
+  }
+  if (heap->max_heap_size > 0 && heap->current_allocated + size > heap->max_heap_size) {
+    return 0;
+  }
+  
+  void *ptr = calloc(1, size);
+  if (ptr) {
+    std::lock_guard<std::mutex> guard(heap->lock);
+    gc_block block = { size, 0, 0, 0, 0 };
+    (*heap->allocations)[ptr] = block;
+    heap->current_allocated += size;
+    heap->min = std::min(heap->min, ptr);
+    heap->max = std::max(heap->max, ptr);
+  }
+  return ptr;
+}
+
+/**
+ *  Same mark and sweep as gc_collect, but only this heap's blocks are
+ *  candidates, so other heaps' blocks are never looked up or traced.  The
+ *  roots are the usual root set plus the ranges declared for this heap.
+ *  Always sweeps right away, and paces with the default heap's growth
+ *  ratio but without its trend and rate estimates.
+ *
+ *  A gc_thread_heap is only rooted in its thread's registers and stack (and
+ *  declared roots), and collecting it touches no state shared with other
+ *  threads but its lock, which only a concurrent shared heap collection
+ *  contends for.
+ */
+void gc_heap_collect(gc_heap_t *heap) {
+  gc_init();
+  uint64_t start_ns = now_ns();
+  std::lock_guard<std::mutex> guard(heap->lock);
+  
+  debug_printf("GC Heap %p START\n", heap);
+  
+  heapmap *marked = new heapmap;
+  gc_reset_mark_counts();
+  auto scan = [heap, marked](void *start, size_t length) {
+    gc_collect_scan_block(start, length, heap->allocations, heap->min, heap->max, marked);
+  };
+  if (heap->thread_local_roots) {
+    gc_scan_thread_roots(scan);
+    for (const auto &root : heap->roots) {
+      scan(root.first, root.second);
+    }
+  }
+  else {
+    gc_scan_roots(heap->roots, false, scan);
+  }
+  
+  // verify_roots only has a snapshot of the full root set
+  if (verify_heap && !heap->thread_local_roots) {
+    gc_verify(heap->allocations, [marked](void *block) { return marked->find(block) == marked->end(); }, "heap collection");
+  }
+  
+  for (const auto &allocation : *heap->allocations) {
+    if (marked->find(allocation.first) == marked->end()) {
+      debug_printf("GC Sweeping %p (%lld bytes)\n", allocation.first, allocation.second.size);
+      if (overwrite_reclaimed_blocks) {
+        memset(allocation.first, 0xab, allocation.second.size);
+      }
+      free(allocation.first);
+      heap->current_allocated -= allocation.second.size;
+    }
+  }
+  delete heap->allocations;
+  heap->allocations = marked;
+  
+  heap->collections++;
+  heap->live_bytes = marked_bytes;
+  heap->heap_goal = std::max((size_t)(marked_bytes * (1 + pacer_growth_ratio)), pacer_min_heap);
+  if (heap->max_heap_size > 0) {
+    heap->heap_goal = std::min(heap->heap_goal, heap->max_heap_size);
+  }
+  heap->last_pause_ns = now_ns() - start_ns;
+  heap->total_pause_ns += heap->last_pause_ns;
+  
+  debug_printf("GC Heap %p DONE, live %zu, goal %zu\n", heap, heap->live_bytes, heap->heap_goal);
+}
+
+/**
+ *  Moves block, and the blocks of thread_heap it reaches, to the shared
+ *  heap.  Called with thread_heap locked, or already unregistered.
+ */
+static void gc_publish_locked(void *block) {
+  std::vector<void *> pending(1, block);
+  while (!pending.empty()) {
+    void *ptr = pending.back();
+    pending.pop_back();
+    auto local = thread_heap->allocations->find(ptr);
+    if (local == thread_heap->allocations->end()) {
+      continue;
+    }
+    gc_block info = local->second;
+    thread_heap->allocations->erase(local);
+    thread_heap->current_allocated -= info.size;
+    
+    (*allocations)[ptr] = info;
+    current_allocated += info.size;
+    allocated_since_collect += info.size;
+    heap_range->min = std::min(heap_range->min, ptr);
+    heap_range->max = std::max(heap_range->max, ptr);
+    
+    void **end = (void **)((uint64_t)ptr + info.size);
+    for (void **p = (void **)ptr; p < end; p++) {
+      auto block = gc_find_block(thread_heap->allocations, *p, thread_heap->min, thread_heap->max);
+      if (block != thread_heap->allocations->end()) {
+        pending.push_back(block->first);
+      }
+    }
+  }
+}
+
+gc_heap_t *gc_thread_heap(bool enable) {
+  gc_init();
+  
+  if (enable && !thread_heap) {
+    thread_heap = gc_heap_create(0);
+    thread_heap->thread_local_roots = true;
+    std::lock_guard<std::mutex> guard(thread_heaps_lock);
+    thread_heaps.push_back(thread_heap);
+  }
+  else if (!enable && thread_heap) {
+    {
+      std::lock_guard<std::mutex> guard(thread_heaps_lock);
+      thread_heaps.erase(std::find(thread_heaps.begin(), thread_heaps.end(), thread_heap));
+    }
+    // Whatever is left may still be referenced, so it all becomes shared
+    std::vector<void *> remaining;
+    for (const auto &block : *thread_heap->allocations) {
+      remaining.push_back(block.first);
+    }
+    for (void *block : remaining) {
+      gc_publish_locked(block);
+    }
+    gc_heap_destroy(thread_heap);
+    thread_heap = 0;
+  }
+  return thread_heap;
+}
+
+void gc_publish(void *obj) {
+  if (!thread_heap) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(thread_heap->lock);
+  gc_publish_locked(obj);
+}
+
+void gc_heap_get_stats(gc_heap_t *heap, gc_stats *stats) {
+  *stats = gc_stats();
+  stats->collections = heap->collections;
+  stats->heap_bytes = heap->current_allocated;
+  stats->live_bytes = heap->live_bytes;
+  stats->heap_goal = heap->heap_goal;
+  stats->trigger_bytes = heap->heap_goal;
+  stats->last_pause_ns = heap->last_pause_ns;
+  stats->total_pause_ns = heap->total_pause_ns;
+  stats->pause_goal_attainment = 1;
+}
+
+void gc_heap_add_root(gc_heap_t *heap, void *start, size_t length) {
+  (heap ? heap->roots : default_roots).push_back(std::make_pair(start, length));
+}
+
+void gc_heap_remove_root(gc_heap_t *heap, void *start) {
+  rootlist &roots = heap ? heap->roots : default_roots;
+  for (auto root = roots.begin(); root != roots.end(); ++root) {
+    if (root->first == start) {
+      roots.erase(root);
+      return;
+    }
+  }
+}
+
+void *gc_alloc_mapped_file(int fd, off_t offset, size_t length, int flags) {
+  gc_init();
+  
+  if (length == 0 || offset < 0 || offset % sysconf(_SC_PAGESIZE) != 0) {
+    errno = EINVAL;
+    return 0;
+  }
+  if (mapped_bytes + length > mapped_trigger_bytes) {
+    // Unmapping what the last collection already found unreachable may be enough
+    gc_sweep_step(SIZE_MAX);
+    if (mapped_bytes + length > mapped_trigger_bytes) {
+      gc_collect_within(pause_goal_ns, true, GC_TRACE_TRIGGER_PACER);
+    }
+  }
+  void *ptr = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, offset);
+  if (ptr == MAP_FAILED) {
+    return 0;
+  }
+  if (flags & GC_MAP_SEQUENTIAL) {
+    madvise(ptr, length, MADV_SEQUENTIAL);
+  }
+  if (flags & GC_MAP_WILLNEED) {
+    madvise(ptr, length, MADV_WILLNEED);
+  }
+  
+  gc_block block = { length, 0, GC_BLOCK_ATOMIC | GC_BLOCK_MAPPED, 0, 0 };
+  (*allocations)[ptr] = block;
+  mapped_bytes += length;
+  heap_range->min = std::min(heap_range->min, ptr);
+  heap_range->max = std::max(heap_range->max, ptr);
+  
+  debug_printf("GC Mapped %zu bytes of fd %d at %p\n", length, fd, ptr);
+  return ptr;
+}
+
+void *gc_alloc_frame(size_t size) {
+  void *site = __builtin_return_address(0);
+  size_t rounded = (size + frame_class_bytes - 1) / frame_class_bytes * frame_class_bytes;
+  if (rounded == 0 || rounded > frame_classes * frame_class_bytes) {
+    return gc_alloc_at(size, site, 0, 0, 0, 0);
+  }
+  
+  // Paced and limited like any other allocation, even when the frame
+  // comes from the cache
+  return gc_alloc_at(rounded, site, GC_BLOCK_FRAME, 0, 0, &frame_cache[rounded / frame_class_bytes - 1]);
+}
+
+/**
+ *  Frees ptr if it is one of heap's blocks, returning whether it was
+ */
+static bool gc_heap_free_block(gc_heap *heap, void *ptr) {
+  std::lock_guard<std::mutex> guard(heap->lock);
+  auto block = heap->allocations->find(ptr);
+  if (block == heap->allocations->end()) {
+    return false;
+  }
+  size_t size = block->second.size;
+  heap->allocations->erase(block);
+  heap->current_allocated -= size;
+  if (overwrite_reclaimed_blocks) {
+    memset(ptr, 0xab, size);
+  }
+  free(ptr);
+  return true;
+}
+
+/**
+ *  Reclaims a block right away.  If it is still waiting on a lazy sweep
+ *  the sweep must not see it again, so it is dropped from the unswept map
+ *  too, stepping the cursor past it if that's where the sweep is.  Blocks
+ *  of other heaps (the calling thread's first) are freed by their heap.
+ */
+void gc_free(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  if (thread_heap && gc_heap_free_block(thread_heap, ptr)) {
+    return;
+  }
+  
+  gc_init();
+  auto block = allocations->find(ptr);
+  if (block == allocations->end()) {
+    std::lock_guard<std::mutex> guard(heaps_lock);
+    for (gc_heap *heap : heaps) {
+      if (heap != thread_heap && gc_heap_free_block(heap, ptr)) {
+        break;
+      }
+    }
+    return;
+  }
+  gc_block info = block->second;
+  allocations->erase(block);
+  
+  if (unswept) {
+    auto pending = unswept->find(ptr);
+    if (pending != unswept->end()) {
+      if (pending == sweep_cursor) {
+        ++sweep_cursor;
+      }
+      unswept->erase(pending);
+      unswept_bytes -= std::min(unswept_bytes, gc_block_heap_bytes(info));
+    }
+  }
+  
+  gc_reclaim_block(ptr, info, GC_TRACE_FREE_EXPLICIT);
+}
+
+/**
+ *  Faults in every page of [base, base + size) for writing
+ */
+static void gc_prefault(char *base, size_t size) {
+#ifdef MADV_POPULATE_WRITE
+  if (!madvise(base, size, MADV_POPULATE_WRITE)) {
+    return;
+  }
+#endif
+  size_t page = sysconf(_SC_PAGESIZE);
+  for (size_t offset = 0; offset < size; offset += page) {
+    // Atomically adding 0 write faults the page without disturbing blocks
+    // the allocator may be carving from it on another thread meanwhile
+    __atomic_fetch_add(base + offset, 0, __ATOMIC_RELAXED);
+  }
+}
+
+bool gc_reserve(size_t bytes, int flags) {
+  gc_init();
+  if (reserve || bytes == 0) {
+    return false;
+  }
+  
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (bytes + page - 1) & ~(page - 1);
+  int mmap_flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_POPULATE
+  if ((flags & GC_RESERVE_PREFAULT) && !(flags & GC_RESERVE_BACKGROUND)) {
+    mmap_flags |= MAP_POPULATE;
+  }
+#endif
+  void *base = mmap(0, size, PROT_READ | PROT_WRITE, mmap_flags, -1, 0);
+  if (base == MAP_FAILED) {
+    debug_printf("GC Reserving %zu bytes failed: %s\n", size, strerror(errno));
+    return false;
+  }
+  
+  reserve = new gc_reserve_area;
+  reserve->base = (char *)base;
+  reserve->size = size;
+  reserve->used = 0;
+  debug_printf("GC Reserved %zu bytes at %p\n", size, base);
+  
+  if (flags & GC_RESERVE_BACKGROUND) {
+    std::thread(gc_prefault, reserve->base, size).detach();
+  }
+  else if (flags & GC_RESERVE_PREFAULT) {
+#ifndef MAP_POPULATE
+    gc_prefault(reserve->base, size);
+#endif
+  }
+  return true;
+}
+
+gc_buffer_pool_t *gc_buffer_pool_create(size_t buffer_size, size_t count) {
+  gc_init();
+  
+  size_t page = sysconf(_SC_PAGESIZE);
+  buffer_size = (buffer_size + page - 1) / page * page;
+  if (buffer_size == 0 || count == 0) {
+    errno = EINVAL;
+    return 0;
+  }
+  void *base = mmap(0, buffer_size * count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (base == MAP_FAILED) {
+    return 0;
+  }
+  
+  gc_buffer_pool *pool = new gc_buffer_pool();
+  pool->base = (char *)base;
+  pool->buffer_size = buffer_size;
+  pool->count = count;
+  for (size_t i = count; i > 0; i--) {
+    pool->free_buffers.push_back(pool->base + (i - 1) * buffer_size);
+  }
+  for (size_t i = 0; i < count; i++) {
+    struct iovec iov = { pool->base + i * buffer_size, buffer_size };
+    pool->iovecs.push_back(iov);
+  }
+  buffer_pools.push_back(pool);
+  
+  debug_printf("GC Buffer pool of %zu x %zu bytes at %p\n", count, buffer_size, base);
+  return pool;
+}
+
+/**
+ *  Hands out a free buffer.  If there are none, finishes any pending sweep
+ *  and then collects, which returns unreachable buffers to their pools.
+ */
+void *gc_buffer_alloc(gc_buffer_pool_t *pool) {
+  gc_init();
+  
+  if (pool->free_buffers.empty() && unswept) {
+    gc_sweep_step(SIZE_MAX);
+  }
+  if (pool->free_buffers.empty()) {
+    gc_collect_within(pause_goal_ns, true, GC_TRACE_TRIGGER_HEAP_FULL);
+    gc_sweep_step(SIZE_MAX);
+  }
+  if (pool->free_buffers.empty()) {
+    return 0;
+  }
+  
+  void *ptr = pool->free_buffers.back();
+  pool->free_buffers.pop_back();
+  gc_block block = { pool->buffer_size, 0, GC_BLOCK_ATOMIC | GC_BLOCK_POOLED, 0, 0 };
+  (*allocations)[ptr] = block;
+  heap_range->min = std::min(heap_range->min, ptr);
+  heap_range->max = std::max(heap_range->max, ptr);
+  return ptr;
+}
+
+const struct iovec *gc_buffer_pool_iovecs(gc_buffer_pool_t *pool, size_t *count) {
+  *count = pool->count;
+  return pool->iovecs.data();
+}
+
+size_t gc_buffer_index(gc_buffer_pool_t *pool, const void *buffer) {
+  return ((const char *)buffer - pool->base) / pool->buffer_size;
+}
+
+gc_stack_t *gc_register_stack(void *base, size_t size) {
+  gc_stack *stack = new gc_stack();
+  stack->base = base;
+  stack->size = size;
+  stack->dirty = true;
+  std::lock_guard<std::mutex> guard(fiber_stacks_lock);
+  stack->index = fiber_stacks.size();
+  fiber_stacks.push_back(stack);
+  return stack;
+}
+
+void gc_unregister_stack(gc_stack_t *stack) {
+  {
+    std::lock_guard<std::mutex> guard(fiber_stacks_lock);
+    fiber_stacks[stack->index] = fiber_stacks.back();
+    fiber_stacks[stack->index]->index = stack->index;
+    fiber_stacks.pop_back();
+  }
+  if (current_stack == stack) {
+    current_stack = 0;
+  }
+  delete stack;
+}
+
+void gc_switch_stack(gc_stack_t *from, gc_stack_t *to, void *saved_sp) {
+  gc_init();
+  
+  if (!from) {
+    if (!own_stack) {
+      own_stack = gc_register_stack(stack_start, stack_length);
+    }
+    from = own_stack;
+  }
+  from->saved_sp = saved_sp ? saved_sp : (void *)get_stack_pointer();
+  from->dirty = true;
+  
+  gc_stack *running = to ? to : own_stack;
+  if (running) {
+    running->saved_sp = 0;
+    running->dirty = true;
+  }
+  current_stack = to;
+}
+
+void gc_touch_stack(gc_stack_t *stack) {
+  stack->dirty = true;
+}
+
+void gc_push_root(void **slot) {
+  if (shadow_depth == shadow_capacity) {
+    size_t capacity = shadow_capacity ? shadow_capacity * 2 : 64;
+    void ***grown = (void ***)realloc(shadow_stack, capacity * sizeof(void **));
+    if (!grown) {
+      fprintf(stderr, "GC Out of memory growing the shadow stack to %zu roots\n", capacity);
+      abort();
+    }
+    shadow_stack = grown;
+    shadow_capacity = capacity;
+  }
+  shadow_stack[shadow_depth++] = slot;
+}
+
+void gc_pop_roots(size_t count) {
+  shadow_depth -= std::min(count, shadow_depth);
+}
+
+void gc_set_precise_roots(bool flag) {
+  precise_roots = flag;
+}
+
+void gc_add_root_callback(gc_root_callback fn, void *ctx) {
+  root_callbacks.push_back(std::make_pair(fn, ctx));
+}
+
+void gc_remove_root_callback(gc_root_callback fn, void *ctx) {
+  auto callback = std::find(root_callbacks.begin(), root_callbacks.end(), std::make_pair(fn, ctx));
+  if (callback != root_callbacks.end()) {
+    root_callbacks.erase(callback);
+  }
+}
+
+void gc_mark_precise(gc_mark_ctx *mark, void *ptr) {
+  if (ptr) {
+    mark->pointers.push_back(ptr);
+  }
+}
+
+void gc_mark_range(gc_mark_ctx *mark, void *start, size_t length) {
+  mark->ranges.push_back(std::make_pair(start, length));
+}
+
+void *gc_alloc_traced(size_t size, gc_trace_fn trace) {
+  auto known = tracer_indexes.find(trace);
+  uint16_t tracer;
+  if (known != tracer_indexes.end()) {
+    tracer = known->second;
+  }
+  else {
+    if (tracers.size() > UINT16_MAX) {
+      fprintf(stderr, "GC Too many trace functions\n");
+      abort();
+    }
+    tracer = (uint16_t)tracers.size();
+    tracers.push_back(trace);
+    tracer_indexes[trace] = tracer;
+  }
+  return gc_alloc_at(size, __builtin_return_address(0), 0, 0, tracer, 0);
+}
+
+void *gc_alloc_tagged(size_t size, uint8_t tag) {
+  return gc_alloc_at(size, __builtin_return_address(0), 0, tag, 0, 0);
+}
+
+void gc_set_tag_budget(uint8_t tag, size_t bytes, gc_tag_budget_callback fn, void *ctx) {
+  tag_stats[tag].budget = bytes;
+  tag_callbacks[tag] = fn;
+  tag_callback_contexts[tag] = ctx;
+}
+
+void gc_get_tag_stats(uint8_t tag, gc_tag_stats *stats) {
+  *stats = tag_stats[tag];
+}
+
+uint64_t gc_now_ns(void) {
+  return now_ns();
+}
+
+void gc_set_pause_goal(uint64_t ns) {
+  pause_goal_ns = ns;
+}
+
+static uint64_t pause_percentile(std::vector<uint64_t> &pauses, double percentile) {
+  if (pauses.empty()) {
+    return 0;
+  }
+  size_t index = (size_t)(percentile * (pauses.size() - 1));
+  std::nth_element(pauses.begin(), pauses.begin() + index, pauses.end());
+  return pauses[index];
+}
+
+void gc_get_stats(gc_stats *stats) {
+  stats->collections = collections;
+  stats->heap_bytes = current_allocated;
+  stats->mapped_bytes = mapped_bytes;
+  stats->reserve_bytes = reserve ? reserve->size : 0;
+  stats->reserve_used_bytes = reserve ? reserve->used : 0;
+  stats->page_faults = gc_page_faults() - page_faults_at_init;
+  stats->stacks_scanned = stacks_scanned;
+  stats->stacks_cached = stacks_cached;
+  stats->live_bytes = live_bytes;
+  stats->live_trend = live_trend;
+  stats->alloc_rate = alloc_rate;
+  stats->mark_rate = mark_rate;
+  stats->sweep_rate = sweep_rate;
+  stats->heap_goal = heap_goal;
+  stats->trigger_bytes = trigger_bytes;
+  stats->unswept_bytes = unswept_bytes;
+  stats->assist_ratio = unswept ? assist_ratio : 0;
+  stats->last_pause_ns = last_pause_ns;
+  stats->total_pause_ns = total_pause_ns;
+  
+  std::vector<uint64_t> pauses(pause_history, pause_history + std::min(pause_count, pause_history_size));
+  size_t within_goal = 0;
+  for (uint64_t pause : pauses) {
+    if (pause <= pause_goal_ns) {
+      within_goal++;
+    }
+  }
+  stats->pause_goal_ns = pause_goal_ns;
+  stats->pause_goal_attainment = pauses.empty() || pause_goal_ns == 0 ? 1 : (double)within_goal / pauses.size();
+  stats->pause_p50_ns = pause_percentile(pauses, 0.5);
+  stats->pause_p90_ns = pause_percentile(pauses, 0.9);
+  stats->pause_p99_ns = pause_percentile(pauses, 0.99);
+  stats->pause_max_ns = pause_percentile(pauses, 1);
+}
+
+size_t gc_heap_bytes(void) {
+  return current_allocated;
+}
+
+size_t gc_block_size(const void *ptr) {
+  gc_init();
+  auto block = allocations->find((void *)ptr);
+  return block == allocations->end() ? 0 : block->second.size;
+}
+
+void gc_set_pointer_decoding(uint64_t mask) {
+  pointer_mask = mask;
+}
+
+void gc_set_max_heap(size_t size) {
+  max_heap_size = size;
+  pacer_update_goal();
+}
+
+void gc_debug_set_max_heap(size_t size) {
+  gc_set_max_heap(size);
+}
+
+void gc_set_census(bool flag) {
+  census_enabled = flag;
+  if (!flag) {
+    census.clear();
+    census_previous.clear();
+  }
+}
+
+size_t gc_get_census(gc_site_census *sites, size_t max_sites) {
+  std::vector<gc_site_census> changed;
+  for (const gc_site_census &site : census) {
+    if (site.live_objects > 0 || site.objects_delta != 0) {
+      changed.push_back(site);
+    }
+  }
+  std::sort(changed.begin(), changed.end(), [](const gc_site_census &a, const gc_site_census &b) {
+    return a.live_bytes > b.live_bytes;
+  });
+  std::copy(changed.begin(), changed.begin() + std::min(max_sites, changed.size()), sites);
+  return changed.size();
+}
+
+static void gc_trace(uint8_t event, uint8_t flags, uint32_t site, const void *address, uint64_t value, uint8_t tag) {
+  gc_trace_entry record;
+  record.event = event;
+  record.flags = flags;
+  record.tag = tag;
+  record.site = site;
+  record.time_ns = now_ns() - trace_start_ns;
+  record.address = (uint64_t)address;
+  record.value = value;
+  fwrite(&record, sizeof(record), 1, trace_file);
+}
+
+bool gc_trace_record(const char *path) {
+  gc_init();
+  gc_trace_stop();
+  
+  trace_file = fopen(path, "wb");
+  if (!trace_file) {
+    return false;
+  }
+  
+  static bool registered_atexit = false;
+  if (!registered_atexit) {
+    atexit(gc_trace_stop);
+    registered_atexit = true;
+  }
+  
+  gc_trace_header header = { GC_TRACE_MAGIC, GC_TRACE_VERSION };
+  fwrite(&header, sizeof(header), 1, trace_file);
+  trace_start_ns = now_ns();
+  return true;
+}
+
+void gc_trace_stop(void) {
+  if (trace_file) {
+    fclose(trace_file);
+    trace_file = 0;
+  }
+}
+
+void gc_trace_store(void **slot, void *value) {
+  *slot = value;
+  if (trace_file) {
+    gc_trace(GC_TRACE_STORE, 0, 0, slot, (uint64_t)value, 0);
+  }
+}
+
+void gc_set_verify(bool flag) {
+  verify_heap = flag;
+}
+
+void gc_debug_enable_verbose_logging(bool flag) {
+  verbose_logging = flag;
+}
+
+void gc_debug_overwrite_reclaimed_blocks(bool flag) {
+  overwrite_reclaimed_blocks = flag;
+}
+
+static void debug_printf(const char *format, ...) {
+  if (!verbose_logging) {
+    return;
+  }
+  va_list args;
+  va_start (args, format);
+  vprintf (format, args);
+  va_end (args);
+}
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 static inline uint64_t get_stack_pointer() {
   uint64_t rsp;
@@ -13,10 +13,12 @@
  *   See the License for the specific language governing permissions and
  *   limitations under the License.
  */
-#ifndef GC_H
-#define GC_H
+#ifndef SIMPLEGC_GC_H
+#define SIMPLEGC_GC_H
 
 #include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
 
 
 /**
@@ -26,18 +28,410 @@
  */
 void *gc_alloc(size_t size);
 
+/**
+ *  Sets aside bytes (rounded up to whole pages) of address space for the
+ *  heap at startup, so that growing into it doesn't fault pages in from
+ *  calloc while the application is busy.  gc_alloc carves blocks from the
+ *  reserve before using calloc, with sizes rounded up to 16 bytes (and
+ *  counted that way in the stats).  Blocks reclaimed there go on a free
+ *  list for their exact size and are only reused for allocations of that
+ *  size, never split or merged.  GC_RESERVE_PREFAULT faults the whole
+ *  reserve in before returning, and GC_RESERVE_BACKGROUND does it on a
+ *  background thread instead.  There is one reserve per process; returns
+ *  false if there already is one or it can't be mapped.
+ */
+enum {
+  GC_RESERVE_PREFAULT = 0x01,
+  GC_RESERVE_BACKGROUND = 0x02,
+};
+
+bool gc_reserve(size_t bytes, int flags);
+
+/**
+ *  Maps length bytes of fd from offset (a multiple of the page size) read
+ *  only, as a block the collector manages like any other: it is munmap'd
+ *  once a collection finds it unreachable.  As with any block only a
+ *  reference to its start, the returned pointer, keeps it mapped; pointers
+ *  into the middle of the file don't.  Its contents are never scanned, and
+ *  it doesn't count towards heap_bytes, the pacer's goal or the heap limit.
+ *  Mapped bytes have a trigger of their own instead: once they grow past
+ *  twice what the last collection found live (or 4MB), mapping more starts
+ *  a collection.  flags are GC_MAP_* hints passed on to madvise.  fd may be
+ *  closed afterwards.  Returns 0 and sets errno on failure.
+ */
+enum {
+  GC_MAP_SEQUENTIAL = 0x01,   // Will be read front to back
+  GC_MAP_WILLNEED = 0x02,     // Start reading it in now
+};
+
+void *gc_alloc_mapped_file(int fd, off_t offset, size_t length, int flags);
+
+/**
+ *  Pools of I/O buffers that can be registered with the kernel once, e.g.
+ *  with io_uring_register_buffers.  A pool is count buffers of buffer_size
+ *  (rounded up to whole pages) carved from one page aligned mapping that
+ *  is pinned: it never moves and is never released, so a registration
+ *  stays valid for the life of the process.  gc_buffer_alloc hands out
+ *  buffers as atomic blocks (never scanned, contents undefined), and once
+ *  a collection finds a buffer unreachable it goes back to the pool.  If
+ *  the pool is empty gc_buffer_alloc collects, and returns 0 if that
+ *  doesn't free a buffer either.  Buffers don't count towards heap_bytes.
+ *
+ *  gc_buffer_pool_iovecs returns one iovec per buffer, in buffer index
+ *  order, and gc_buffer_index a buffer's index (e.g. for READ_FIXED).
+ */
+typedef struct gc_buffer_pool gc_buffer_pool_t;
+struct iovec;
+
+gc_buffer_pool_t *gc_buffer_pool_create(size_t buffer_size, size_t count);
+void *gc_buffer_alloc(gc_buffer_pool_t *pool);
+const struct iovec *gc_buffer_pool_iovecs(gc_buffer_pool_t *pool, size_t *count);
+size_t gc_buffer_index(gc_buffer_pool_t *pool, const void *buffer);
+
+/**
+ *  Frees a block allocated by gc_alloc, gc_alloc_frame or gc_heap_alloc
+ *  right away, for callers that know it is garbage.  It must not be referenced anywhere
+ *  afterwards.  Blocks the collector doesn't manage are ignored.
+ */
+void gc_free(void *ptr);
+
+/**
+ *  Like gc_alloc, for short lived objects such as coroutine frames (see
+ *  gc_coroutine.h) that are usually released with gc_free.  Sizes up to 4k
+ *  are rounded up to a multiple of 64 bytes, and freed frames are cached
+ *  per size for the next allocation of that size.  Cached frames don't
+ *  count towards the heap, and a collection frees those that went unused
+ *  since the previous one.
+ */
+void *gc_alloc_frame(size_t size);
+
 /**
  *  You shouldn't need to call this, it is here for debugging/testing purposes.
  */
 void gc_collect(void);
 
 /**
- *  For debugging/testing garbage collection.  Will act
- *  like the underlying heap is only size large.  Will thus
- *  force more GC and potential returning of null from gc_alloc.
+ *  Snapshot of the collector's bookkeeping.  The rates and the live set
+ *  trend are smoothed over recent collections and drive the pacer, which
+ *  decides how large the heap may grow before gc_alloc starts the next
+ *  collection on its own.
+ */
+struct gc_stats {
+  size_t collections;       // Completed gc_collect cycles
+  size_t heap_bytes;        // Bytes currently allocated via gc_alloc
+  size_t mapped_bytes;      // Bytes of files mapped by gc_alloc_mapped_file, not in heap_bytes
+  size_t reserve_bytes;     // Size of the gc_reserve reserve
+  size_t reserve_used_bytes;  // ... and how much of it blocks have been carved from
+  size_t page_faults;       // Page faults in the process since the collector started
+  size_t stacks_scanned;    // Suspended fiber stacks scanned by the last collection
+  size_t stacks_cached;     // ... and those it skipped because they hadn't run since
+  size_t live_bytes;        // Bytes that survived the most recent collection
+  double live_trend;        // Smoothed change in live_bytes per collection
+  double alloc_rate;        // Smoothed allocation rate between collections (bytes/sec)
+  double mark_rate;         // Smoothed marking rate (bytes/sec)
+  double sweep_rate;        // Smoothed sweeping rate (bytes/sec)
+  size_t heap_goal;         // Heap size the pacer aims to stay under
+  size_t trigger_bytes;     // gc_alloc collects before growing the heap past this (past heap_goal
+                            // while backing off from collections that reclaimed little)
+  size_t unswept_bytes;     // Bytes still waiting on an incremental sweep
+  double assist_ratio;      // Bytes gc_alloc sweeps per byte allocated
+  uint64_t last_pause_ns;   // Duration of the most recent collection
+  uint64_t total_pause_ns;  // All collections and incremental sweep slices
+  
+  // Over the recent pauses, i.e. collections and incremental sweep slices
+  uint64_t pause_goal_ns;
+  double pause_goal_attainment;   // Fraction of pauses within the goal
+  uint64_t pause_p50_ns;
+  uint64_t pause_p90_ns;
+  uint64_t pause_p99_ns;
+  uint64_t pause_max_ns;
+};
+
+void gc_get_stats(gc_stats *stats);
+
+/**
+ *  Same as gc_get_stats' heap_bytes, but cheap enough to call after every
+ *  allocation, e.g. to track the peak heap size.
+ */
+size_t gc_heap_bytes(void);
+
+/**
+ *  Size of the shared heap block that ptr is the start of, or 0 if it isn't
+ *  one any more, including when the last collection found it unreachable
+ *  but hasn't swept it yet.  For tools that track blocks without keeping
+ *  them alive, such as simplegc_replay.
+ */
+size_t gc_block_size(const void *ptr);
+
+/**
+ *  Asks the collector to keep pauses under ns nanoseconds (0, the default,
+ *  means no goal).  Using the timings of previous collections each cycle
+ *  decides whether to sweep immediately or, if that would overrun the goal,
+ *  to sweep incrementally from gc_alloc in slices sized to fit it.  Marking
+ *  is not incremental, so a pause can't get shorter than the mark.
+ */
+void gc_set_pause_goal(uint64_t ns);
+
+/**
+ *  Does as much collection work as fits before deadline_ns (on the
+ *  gc_now_ns clock), e.g. in an event loop's idle time.  Finishes any
+ *  incremental sweep first, then collects if the heap has grown and the
+ *  mark is expected to fit.  Returns true if a collection cycle, including
+ *  its sweep, completed during the call.
+ */
+bool gc_collect_idle(uint64_t deadline_ns);
+
+/**
+ *  Allocation regions for request scoped temporaries.  Blocks allocated
+ *  between gc_region_begin and gc_region_end don't count towards the
+ *  pacer's trigger.  At gc_region_end those still referenced from outside
+ *  the region (roots or other heap blocks) become ordinary heap blocks,
+ *  and the rest are freed immediately.  Regions may nest, but only the
+ *  outermost gc_region_end reclaims anything.  Returns the bytes freed.
+ *  Finding escapes means scanning every block allocated outside the
+ *  region, so gc_region_end costs time proportional to the whole heap.
+ */
+void gc_region_begin(void);
+size_t gc_region_end(void);
+
+/**
+ *  Independent heaps, e.g. one per tenant.  Each has its own blocks, limit
+ *  (max_heap, 0 for none), pacing and stats, and collecting it only looks
+ *  at its own blocks, so a large heap doesn't slow down a small one.  The
+ *  roots are the usual registers, stack and data segment, but not other
+ *  heaps' blocks: a block reachable only from another heap's block must be
+ *  declared with gc_heap_add_root.  gc_heap_destroy frees all the heap's
+ *  blocks, reachable or not.
+ *
+ *  Heaps only hold plain blocks and always sweep right away.  Everything
+ *  else belongs to the default heap: the pause goal and gc_collect_idle,
+ *  regions, the census, tags, trace recording, gc_reserve, and frames,
+ *  buffers, mapped files and traced blocks, which are always allocated
+ *  there.  A gc_heap_alloc block is never part of a region, never counted
+ *  by the census or tags and never recorded.  gc_free frees it though.
+ */
+typedef struct gc_heap gc_heap_t;
+
+gc_heap_t *gc_heap_create(size_t max_heap);
+void gc_heap_destroy(gc_heap_t *heap);
+void *gc_heap_alloc(gc_heap_t *heap, size_t size);
+void gc_heap_collect(gc_heap_t *heap);
+void gc_heap_get_stats(gc_heap_t *heap, gc_stats *stats);
+
+/**
+ *  Declares [start, start + length) as a root of heap (0 for the default
+ *  heap used by gc_alloc), e.g. another heap's block holding references
+ *  into it.  It is scanned conservatively at every collection of that heap
+ *  until removed with gc_heap_remove_root.
+ */
+void gc_heap_add_root(gc_heap_t *heap, void *start, size_t length);
+void gc_heap_remove_root(gc_heap_t *heap, void *start);
+
+/**
+ *  Thread-local heaps.  With gc_thread_heap(true), gc_alloc on the calling
+ *  thread allocates from a heap of its own, returned so it can be collected
+ *  with gc_heap_collect from that thread.  That collection scans only the
+ *  thread's registers and stack (and roots declared for the heap), so it
+ *  needs nothing from other threads, which keep running.  Blocks stay
+ *  local until gc_publish(obj) moves obj and the local blocks it reaches to
+ *  the shared heap.  Anything stored where other threads or globals can see
+ *  it must be published first, or a local collection may free it.  Shared
+ *  collections (gc_collect) treat local blocks as roots.  Only gc_alloc
+ *  uses the thread's heap, the other allocators keep using the shared one.
+ *
+ *  gc_thread_heap(false) publishes what is left and goes back to the shared
+ *  heap, and must be called before the thread exits.  gc_heap_destroy on
+ *  the thread's heap (from that thread) instead frees what is left, as for
+ *  any heap, and also goes back to the shared heap.  Like gc_alloc on the
+ *  shared heap, gc_publish and gc_thread_heap need to be serialized with
+ *  other threads' use of the shared heap.
+ */
+gc_heap_t *gc_thread_heap(bool enable);
+void gc_publish(void *obj);
+
+/**
+ *  Fiber (user space) stacks.  Collections scan the stack the calling
+ *  thread is running on, so stacks of suspended fibers have to be
+ *  registered to be roots.  base is the lowest address of the stack and
+ *  stacks grow down from base + size.
+ *
+ *  Call gc_switch_stack right before switching from one stack to another,
+ *  0 meaning the thread's own stack.  saved_sp is where the suspended
+ *  stack's live part starts, or 0 for the stack pointer at the call, which
+ *  covers the caller's frame.  Registers saved by the switch must be kept
+ *  somewhere scanned, e.g. a ucontext_t on the suspended stack itself.
+ *
+ *  A suspended stack that hasn't run since the last collection isn't
+ *  rescanned, the pointers found in it last time are reused.  Anything
+ *  else that writes into a suspended stack must call gc_touch_stack.
+ *  Stacks that did run are scanned in parallel when there are enough.
+ */
+typedef struct gc_stack gc_stack_t;
+
+gc_stack_t *gc_register_stack(void *base, size_t size);
+void gc_unregister_stack(gc_stack_t *stack);
+void gc_switch_stack(gc_stack_t *from, gc_stack_t *to, void *saved_sp);
+void gc_touch_stack(gc_stack_t *stack);
+
+/**
+ *  Precise roots.  gc_push_root(&var) pushes the address of a pointer
+ *  variable onto the calling thread's shadow stack, and gc_pop_roots(n)
+ *  pops the last n, so pushes and pops must nest like the variables' scopes.
+ *  GC_ROOT(var) does both for the rest of the enclosing scope, and can be
+ *  used several times on one line.
+ *
+ *  With gc_set_precise_roots(true), collections run by the thread scan only
+ *  its shadow stack instead of its registers and stack, which is faster and
+ *  doesn't retain blocks through stale stack words.  Every pointer the
+ *  thread's code needs across an allocation must then be in a pushed
+ *  variable.  Other roots (the data segment, fiber stacks, declared roots)
+ *  are still scanned conservatively.  Blocks are never moved, whether or
+ *  not they are only referenced precisely.
+ */
+void gc_push_root(void **slot);
+void gc_pop_roots(size_t count);
+void gc_set_precise_roots(bool flag);
+
+struct gc_root_guard {
+  explicit gc_root_guard(void **slot) { gc_push_root(slot); }
+  ~gc_root_guard() { gc_pop_roots(1); }
+};
+
+#define GC_ROOT_CONCAT2(a, b) a##b
+#define GC_ROOT_CONCAT(a, b) GC_ROOT_CONCAT2(a, b)
+#define GC_ROOT(var) gc_root_guard GC_ROOT_CONCAT(gc_root_, __COUNTER__)((void **)&(var))
+
+/**
+ *  Root callbacks, for runtimes that keep references in their own
+ *  structures (VM stacks, globals tables) outside the memory the collector
+ *  scans.  Every collection calls each callback added with
+ *  gc_add_root_callback during its root phase, with the ctx it was added
+ *  with and a gc_mark_ctx to report references to: gc_mark_precise for a
+ *  pointer known to be a block (or 0), gc_mark_range for memory to scan
+ *  conservatively.  With several callbacks they run in parallel on worker
+ *  threads, so a callback must not allocate or otherwise call into the
+ *  collector but through its gc_mark_ctx.
+ */
+typedef struct gc_mark_ctx gc_mark_ctx;
+typedef void (*gc_root_callback)(gc_mark_ctx *mark, void *ctx);
+
+void gc_add_root_callback(gc_root_callback fn, void *ctx);
+void gc_remove_root_callback(gc_root_callback fn, void *ctx);
+void gc_mark_precise(gc_mark_ctx *mark, void *ptr);
+void gc_mark_range(gc_mark_ctx *mark, void *start, size_t length);
+
+/**
+ *  Like gc_alloc, but instead of scanning the block's words a collection
+ *  calls trace(obj, mark) to report the block's references through mark
+ *  (see gc_mark_precise and gc_mark_range), e.g. for records whose pointer
+ *  fields depend on a header.  trace is called from the middle of the mark
+ *  and must only read obj and report, not allocate or call the collector
+ *  otherwise.  Up to 65535 distinct trace functions are supported.
+ */
+typedef void (*gc_trace_fn)(void *obj, gc_mark_ctx *mark);
+
+void *gc_alloc_traced(size_t size, gc_trace_fn trace);
+
+/**
+ *  Memory accounting by subsystem.  gc_alloc_tagged allocates like gc_alloc
+ *  but charges the block to tag (1-255, gc_alloc's blocks have tag 0).
+ *  Every collection of the default heap counts the live blocks and bytes
+ *  per tag as it marks them, for gc_get_tag_stats.  gc_set_tag_budget
+ *  gives a tag a budget (0 for none), and after any collection that finds
+ *  the tag over it calls fn(tag, live_bytes, budget, ctx).  Tagged blocks
+ *  always come from the shared heap, even with gc_thread_heap enabled.
+ */
+struct gc_tag_stats {
+  size_t live_objects;      // As of the last collection
+  size_t live_bytes;
+  size_t budget;
+};
+
+typedef void (*gc_tag_budget_callback)(uint8_t tag, size_t live_bytes, size_t budget, void *ctx);
+
+void *gc_alloc_tagged(size_t size, uint8_t tag);
+void gc_set_tag_budget(uint8_t tag, size_t bytes, gc_tag_budget_callback fn, void *ctx);
+void gc_get_tag_stats(uint8_t tag, gc_tag_stats *stats);
+
+/**
+ *  Current time on the monotonic clock used by the collector, in ns.
+ */
+uint64_t gc_now_ns(void);
+
+/**
+ *  Limits the heap to size bytes (0, the default, means no limit).  The
+ *  pacer never lets its goal exceed the limit, and gc_alloc returns 0 if
+ *  a collection can't free enough room under it.
+ */
+void gc_set_max_heap(size_t size);
+
+/**
+ *  Older name for gc_set_max_heap, kept for existing callers.
  */
 void gc_debug_set_max_heap(size_t size);
 
+/**
+ *  Makes scanning recognize tagged references.  A word that isn't a
+ *  block's address is decoded as word & mask and matched again, e.g. a
+ *  mask of 0x0000fffffffffff8 clears low tag bits and strips NaN-boxing's
+ *  high 16 bits.  Words are always tried as they are first, so untagged
+ *  pointers and those reported with gc_mark_precise are never decoded.
+ *  Blocks are at least 16 byte aligned, so clearing up to 4 low bits is
+ *  safe.  The default (all ones) leaves words as they are.
+ */
+void gc_set_pointer_decoding(uint64_t mask);
+
+/**
+ *  Records allocations, frees and collections to a trace file at path
+ *  (format in gc_trace.h) until gc_trace_stop or exit, for replaying
+ *  offline with simplegc_replay.  Returns false if path can't be opened.
+ */
+bool gc_trace_record(const char *path);
+void gc_trace_stop(void);
+
+/**
+ *  Performs *slot = value, and if a trace is being recorded also records
+ *  the store so a replay can rebuild the same object graph.  Only stores
+ *  made through here are recorded.
+ */
+void gc_trace_store(void **slot, void *value);
+
+/**
+ *  If set to true, every collection (and gc_region_end) is checked against
+ *  a deliberately simple reference mark over the same roots.  Any block the
+ *  collector was about to free that the reference found reachable is
+ *  reported to stderr and the process aborts.  Slow, meant for staging.
+ */
+void gc_set_verify(bool flag);
+
+/**
+ *  Live blocks allocated from one call site as of the last collection, and
+ *  how they changed since the collection before it.
+ */
+struct gc_site_census {
+  void *site;               // Return address of the gc_alloc call, 0 for blocks allocated before the census was on
+  size_t live_objects;
+  size_t live_bytes;
+  int64_t objects_delta;
+  int64_t bytes_delta;
+};
+
+/**
+ *  If set to true, every block remembers its allocating call site and each
+ *  collection takes a census of the live blocks per site.  Costs a table
+ *  lookup per allocation and a pass over the live set per collection,
+ *  meant for staging.
+ */
+void gc_set_census(bool flag);
+
+/**
+ *  Copies up to max_sites entries of the last census, largest live_bytes
+ *  first, into sites.  Sites with no live blocks left are included if they
+ *  had some at the previous collection.  Returns the number of entries
+ *  available, which may be more than max_sites.
+ */
+size_t gc_get_census(gc_site_census *sites, size_t max_sites);
+
 /**
  *  If set to true, will dump to stdout vebose info on the mark/sweep
  *  collection process, as well as location of the data and stack segments
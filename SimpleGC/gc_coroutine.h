@@ -0,0 +1,59 @@
+/**
+ *   Copyright 2015 Garrick Toubassi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef SIMPLEGC_GC_COROUTINE_H
+#define SIMPLEGC_GC_COROUTINE_H
+
+#include <new>
+#include "gc.h"
+
+/**
+ *  Base class for coroutine promise types whose frames should come from
+ *  the GC heap.  A coroutine's frame is allocated with the promise type's
+ *  operator new, so
+ *
+ *    struct promise_type : gc_coroutine_promise { ... };
+ *
+ *  gets frames from gc_alloc_frame's size classes instead of malloc, and
+ *  completed frames destroyed by the coroutine machinery go straight back
+ *  through gc_free.  Only standard class-specific allocation functions are
+ *  used, so the same mixin works for any class with this lifetime pattern.
+ *
+ *  Suspended frames are ordinary blocks and are scanned conservatively, so
+ *  the GC pointers they hold stay alive.  By the same token a suspended
+ *  coroutine must itself be reachable, i.e. its handle has to be kept
+ *  where the collector scans: the stack, globals, GC blocks, or memory
+ *  declared with gc_heap_add_root.  Unreachable frames are reclaimed
+ *  without running their destructors.
+ */
+struct gc_coroutine_promise {
+  static void *operator new(size_t size) {
+    void *frame = gc_alloc_frame(size);
+    if (!frame) {
+      throw std::bad_alloc();
+    }
+    return frame;
+  }
+  
+  static void operator delete(void *frame) {
+    gc_free(frame);
+  }
+  
+  static void operator delete(void *frame, size_t) {
+    gc_free(frame);
+  }
+};
+
+#endif
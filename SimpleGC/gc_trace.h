@@ -0,0 +1,82 @@
+/**
+ *   Copyright 2015 Garrick Toubassi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef SIMPLEGC_GC_TRACE_H
+#define SIMPLEGC_GC_TRACE_H
+
+#include <cstdio>
+#include <cstdint>
+
+/**
+ *  Format of the files written by gc_trace_record and read by the replay
+ *  tool.  A trace is a gc_trace_header followed by gc_trace_entry records
+ *  in the order the events happened, in native byte order.
+ */
+
+#define GC_TRACE_MAGIC 0x31435447 // "GTC1"
+#define GC_TRACE_VERSION 2
+
+struct gc_trace_header {
+  uint32_t magic;
+  uint32_t version;
+};
+
+enum gc_trace_event {
+  GC_TRACE_ALLOC = 1,     // address, value = size, site, tag, flags = GC_TRACE_IN_REGION etc.
+  GC_TRACE_FREE = 2,      // address, value = size, flags = GC_TRACE_FREE_*
+  GC_TRACE_COLLECT = 3,   // address = mark ns, value = live bytes, flags = GC_TRACE_TRIGGER_*
+  GC_TRACE_STORE = 4,     // address = slot, value = pointer stored there
+};
+
+// Flags on GC_TRACE_ALLOC: where the block was allocated and its kind
+#define GC_TRACE_IN_REGION 0x01
+#define GC_TRACE_ATOMIC 0x02      // Never scanned
+#define GC_TRACE_FRAME 0x04       // From gc_alloc_frame
+#define GC_TRACE_TRACED 0x08      // From gc_alloc_traced
+
+// Why a block was freed (GC_TRACE_FREE)
+enum {
+  GC_TRACE_FREE_SWEPT = 0,
+  GC_TRACE_FREE_REGION_END = 1,
+  GC_TRACE_FREE_EXPLICIT = 2,
+};
+
+// What started a collection (GC_TRACE_COLLECT)
+enum {
+  GC_TRACE_TRIGGER_EXPLICIT = 0,  // gc_collect
+  GC_TRACE_TRIGGER_PACER = 1,     // Heap grew past the pacer's trigger
+  GC_TRACE_TRIGGER_HEAP_FULL = 2, // An allocation failed
+  GC_TRACE_TRIGGER_IDLE = 3,      // gc_collect_idle
+};
+
+struct gc_trace_entry {
+  uint8_t event;
+  uint8_t flags;
+  uint16_t tag;       // gc_alloc_tagged tag of an allocated block, else 0
+  uint32_t site;      // Hash of the allocating call site
+  uint64_t time_ns;   // Since recording started
+  uint64_t address;
+  uint64_t value;
+};
+
+/**
+ *  Reads the header of a trace, returning false if it isn't one we understand.
+ */
+inline bool gc_trace_read_header(FILE *file) {
+  gc_trace_header header;
+  return fread(&header, sizeof(header), 1, file) == 1 && header.magic == GC_TRACE_MAGIC && header.version == GC_TRACE_VERSION;
+}
+
+#endif
@@ -15,7 +15,14 @@
  */
 #include <iostream>
 #include <cstdarg>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "gc.h"
+#include "gc_trace.h"
+#include "gc_coroutine.h"
 
 #define TEST_MAX_HEAP 8*1024*1024
 
@@ -97,6 +104,100 @@ void testChurnBeyondHeap() {
   assertTrue(1, __LINE__, "Will crash if it fails");
 }
 
+void testPacerKeepsHeapUnderGoal() {
+  gc_stats before, after;
+  gc_get_stats(&before);
+  for (int i = 0; i < TEST_MAX_HEAP/1024; i++) {
+    gc_alloc_or_die(1024);
+  }
+  gc_get_stats(&after);
+  assertTrue(after.collections > before.collections, __LINE__, "Pacer never started a collection");
+  assertTrue(after.heap_bytes <= after.heap_goal, __LINE__, "Heap %ld grew past goal %ld", after.heap_bytes, after.heap_goal);
+  assertTrue(after.mark_rate > 0, __LINE__, "Mark rate was not measured");
+}
+
+void testPauseGoalDefersSweep() {
+  gc_set_pause_goal(1);
+  for (int i = 0; i < 1024; i++) {
+    gc_alloc_or_die(1024);
+  }
+  gc_collect();
+  gc_stats stats;
+  gc_get_stats(&stats);
+  assertTrue(stats.unswept_bytes > 0, __LINE__, "Sweep was not deferred under a 1ns pause goal");
+  assertTrue(stats.pause_goal_attainment < 1, __LINE__, "Pauses unexpectedly met a 1ns goal");
+  
+  // Allocation assists with the sweep, finishing it before the next collection
+  size_t collections = stats.collections;
+  while (stats.unswept_bytes > 0 && stats.collections == collections) {
+    gc_alloc_or_die(1024);
+    gc_get_stats(&stats);
+  }
+  assertTrue(stats.collections == collections, __LINE__, "Incremental sweep was finished by a collection");
+  gc_set_pause_goal(0);
+}
+
+void testIdleCollection() {
+  for (int i = 0; i < 1024; i++) {
+    gc_alloc_or_die(1024);
+  }
+  gc_stats before, after;
+  gc_get_stats(&before);
+  bool completed = gc_collect_idle(gc_now_ns() + 1000*1000*1000);
+  gc_get_stats(&after);
+  assertTrue(completed, __LINE__, "Idle collection did not complete within a second");
+  assertTrue(after.collections == before.collections + 1, __LINE__, "Idle collection did not collect");
+  assertTrue(after.unswept_bytes == 0, __LINE__, "Idle collection left %ld bytes unswept", after.unswept_bytes);
+  assertTrue(!gc_collect_idle(gc_now_ns()), __LINE__, "Idle collection completed with no time");
+}
+
+static void *escapedPtr;
+void testRegionReclaimsTemporaries() {
+  gc_region_begin();
+  for (int i = 0; i < 100; i++) {
+    gc_alloc_or_die(1024);
+  }
+  escapedPtr = gc_alloc_or_die(1024);
+  size_t reclaimed = gc_region_end();
+  assertTrue(reclaimed > 0, __LINE__, "Region end reclaimed nothing");
+  assertTrue('\xab' != *(char *)escapedPtr, __LINE__, "Escaped block %p unexpectedly reclaimed", escapedPtr);
+  escapedPtr = 0;
+}
+
+void testTraceRecording() {
+  const char *path = "/tmp/simplegc_test.trace";
+  assertTrue(gc_trace_record(path), __LINE__, "Could not record trace to %s", path);
+  void **head = (void **)gc_alloc_or_die(sizeof(void *));
+  gc_trace_store(head, gc_alloc_or_die(16));
+  gc_free(gc_alloc_frame(64));
+  gc_alloc_tagged(32, 7);
+  gc_collect();
+  gc_trace_stop();
+  
+  int counts[GC_TRACE_STORE + 1] = { 0 };
+  int frames = 0, tagged = 0;
+  FILE *file = fopen(path, "rb");
+  assertTrue(file && gc_trace_read_header(file), __LINE__, "Trace %s has no header", path);
+  gc_trace_entry entry;
+  while (file && fread(&entry, sizeof(entry), 1, file) == 1) {
+    if (entry.event <= GC_TRACE_STORE) {
+      counts[entry.event]++;
+    }
+    if (entry.event == GC_TRACE_ALLOC) {
+      frames += (entry.flags & GC_TRACE_FRAME) != 0;
+      tagged += entry.tag == 7;
+    }
+  }
+  if (file) {
+    fclose(file);
+  }
+  remove(path);
+  assertTrue(counts[GC_TRACE_ALLOC] == 4, __LINE__, "Expected 4 traced allocations, got %d", counts[GC_TRACE_ALLOC]);
+  assertTrue(frames == 1 && tagged == 1, __LINE__, "Expected 1 traced frame and 1 tagged block, got %d and %d", frames, tagged);
+  assertTrue(counts[GC_TRACE_STORE] == 1, __LINE__, "Expected 1 traced store, got %d", counts[GC_TRACE_STORE]);
+  assertTrue(counts[GC_TRACE_COLLECT] == 1, __LINE__, "Expected 1 traced collection, got %d", counts[GC_TRACE_COLLECT]);
+}
+
 /**
  * In order to get reproducible test results we need to zero out the stack.
  * Quite often pointers that we expect to be collected end up in temporary variables
@@ -104,13 +205,643 @@ void testChurnBeyondHeap() {
  * reproducible set of test cases we avoid such ambiguity.
  */
 void clearStack() {
-  memset(alloca(1024), 0, 1024);
+  void *stack = alloca(1024);
+  memset(stack, 0, 1024);
+  // Optimized builds would otherwise drop the memset as a dead store
+  __asm__ __volatile__("" : : "r"(stack) : "memory");
+}
+
+// Addresses of the lowest and highest region blocks, hidden from the scan
+static const uintptr_t hideMask = 0x5555555555555555ULL;
+static uintptr_t lowestRegionBlock, highestRegionBlock;
+
+// Takes the block as an argument so no pointer to it stays in allocRegionGarbage's frame
+__attribute__((noinline)) void noteRegionBlock(uintptr_t block) {
+  lowestRegionBlock = std::min(lowestRegionBlock ^ hideMask, block) ^ hideMask;
+  highestRegionBlock = std::max(highestRegionBlock ^ hideMask, block) ^ hideMask;
+}
+
+__attribute__((noinline)) void allocRegionGarbage() {
+  lowestRegionBlock = UINTPTR_MAX ^ hideMask;
+  highestRegionBlock = hideMask;
+  for (int i = 0; i < 100; i++) {
+    noteRegionBlock((uintptr_t)gc_alloc_or_die(1024));
+  }
+}
+
+void testRegionReclaimsLowestAndHighest() {
+  gc_region_begin();
+  allocRegionGarbage();
+  clearStack();
+  gc_region_end();
+  char *lowest = (char *)(lowestRegionBlock ^ hideMask);
+  char *highest = (char *)(highestRegionBlock ^ hideMask);
+  assertTrue(lowest[512] == (char)0xab, __LINE__, "Lowest region block %p not reclaimed", lowest);
+  assertTrue(highest[512] == (char)0xab, __LINE__, "Highest region block %p not reclaimed", highest);
+}
+
+void testRegionEndWithPendingSweep() {
+  gc_set_pause_goal(1);
+  gc_region_begin();
+  for (int i = 0; i < 200; i++) {
+    gc_alloc_or_die(1024);
+  }
+  gc_collect();
+  gc_region_end();
+  gc_set_pause_goal(0);
+  gc_collect();
+  
+  gc_stats stats;
+  gc_get_stats(&stats);
+  assertTrue(stats.unswept_bytes == 0, __LINE__, "Expected nothing unswept, got %zu", stats.unswept_bytes);
+  assertTrue(stats.heap_bytes < 100 * 1024, __LINE__, "Expected the region's blocks reclaimed, heap is %zu bytes", stats.heap_bytes);
+}
+
+static void *taggedPtr;
+static double boxedValue;
+
+// Allocates the tagged blocks in a frame of its own, so the only references
+// left to them are the tagged globals
+__attribute__((noinline)) void allocTaggedBlocks() {
+  // Low-bit tag, like SCRAMBLE
+  taggedPtr = SCRAMBLE(gc_alloc_or_die(1024));
+  
+  // NaN-boxed
+  uint64_t bits = 0xfff9000000000000ULL | (uint64_t)gc_alloc_or_die(1024);
+  memcpy(&boxedValue, &bits, sizeof(bits));
+}
+
+void testTaggedPointers() {
+  gc_set_pointer_decoding(0x0000fffffffffff8ULL);
+  
+  allocTaggedBlocks();
+  clearStack();
+  gc_collect();
+  uint64_t bits;
+  memcpy(&bits, &boxedValue, sizeof(bits));
+  void *untagged = UNSCRAMBLE(taggedPtr);
+  void *unboxed = (void *)(bits & 0x0000ffffffffffffULL);
+  assertTrue('\xab' != *(char *)untagged, __LINE__, "Block %p referenced by a tagged pointer was collected", untagged);
+  assertTrue('\xab' != *(char *)unboxed, __LINE__, "Block %p referenced by a NaN-boxed value was collected", unboxed);
+  gc_set_pointer_decoding(UINT64_MAX);
+}
+
+void testTaggedPointersIgnoredWithoutDecoding() {
+  gc_collect();
+  void *untagged = UNSCRAMBLE(taggedPtr);
+  assertTrue('\xab' == *(char *)untagged, __LINE__, "Block %p unexpectedly NOT collected without decoding", untagged);
+  taggedPtr = 0;
+  boxedValue = 0;
+}
+
+static gc_heap_t *tenantHeap;
+static void **tenantRoot;
+
+void testHeapsCollectIndependently() {
+  tenantHeap = gc_heap_create(TEST_MAX_HEAP);
+  tenantRoot = (void **)gc_heap_alloc(tenantHeap, 4 * sizeof(void *));
+  tenantRoot[0] = gc_heap_alloc(tenantHeap, 1024);
+  
+  // Only referenced from the tenant heap, so it must be declared
+  tenantRoot[1] = gc_alloc_or_die(1024);
+  gc_heap_add_root(0, tenantRoot, 4 * sizeof(void *));
+  
+  for (int i = 0; i < 100; i++) {
+    gc_heap_alloc(tenantHeap, 1024);
+  }
+  gc_heap_collect(tenantHeap);
+  
+  gc_stats stats;
+  gc_heap_get_stats(tenantHeap, &stats);
+  assertTrue(stats.collections >= 1, __LINE__, "Tenant heap never collected");
+  // Allow for a few blocks kept alive by stale stack words
+  assertTrue(stats.heap_bytes < 10 * 1024, __LINE__, "Tenant heap has %zu bytes after collecting its garbage", stats.heap_bytes);
+  assertTrue('\xab' != *(char *)tenantRoot[0], __LINE__, "Tenant block %p unexpectedly collected", tenantRoot[0]);
+  
+  gc_collect();
+  assertTrue('\xab' != *(char *)tenantRoot[1], __LINE__, "Block %p referenced from a declared root was collected", tenantRoot[1]);
+  
+  gc_heap_get_stats(tenantHeap, &stats);
+  size_t before = stats.heap_bytes;
+  gc_free(tenantRoot[0]);
+  gc_heap_get_stats(tenantHeap, &stats);
+  assertTrue(stats.heap_bytes == before - 1024, __LINE__, "gc_free didn't free a tenant block, heap went from %zu to %zu bytes", before, stats.heap_bytes);
+  
+  gc_heap_remove_root(0, tenantRoot);
+  gc_heap_destroy(tenantHeap);
+  tenantHeap = 0;
+  tenantRoot = 0;
+}
+
+static void **publishedPtr;
+
+void testThreadHeapPublish() {
+  gc_heap_t *local = gc_thread_heap(true);
+  assertTrue(local != 0, __LINE__, "No thread heap");
+  
+  gc_stats stats;
+  void **shared = (void **)gc_alloc_or_die(2 * sizeof(void *));
+  shared[0] = gc_alloc_or_die(32);
+  gc_heap_get_stats(local, &stats);
+  assertTrue(stats.heap_bytes == 2 * sizeof(void *) + 32, __LINE__, "Expected the thread heap to hold 2 blocks, has %zu bytes", stats.heap_bytes);
+  
+  gc_publish(shared);
+  publishedPtr = shared;
+  gc_heap_get_stats(local, &stats);
+  assertTrue(stats.heap_bytes == 0, __LINE__, "Publishing left %zu bytes in the thread heap", stats.heap_bytes);
+  
+  for (int i = 0; i < 100; i++) {
+    gc_alloc_or_die(1024);
+  }
+  gc_heap_collect(local);
+  gc_heap_get_stats(local, &stats);
+  assertTrue(stats.heap_bytes < 10 * 1024, __LINE__, "Thread heap has %zu bytes after a local collection", stats.heap_bytes);
+  
+  gc_thread_heap(false);
+  shared = 0;
+  gc_collect();
+  assertTrue('\xab' != *(char *)publishedPtr, __LINE__, "Published block %p unexpectedly collected", publishedPtr);
+  assertTrue('\xab' != *(char *)publishedPtr[0], __LINE__, "Block %p reachable from a published block was collected", publishedPtr[0]);
+  publishedPtr = 0;
+}
+
+void testThreadHeapDestroy() {
+  gc_heap_t *local = gc_thread_heap(true);
+  gc_alloc_or_die(1024);
+  gc_heap_destroy(local);
+  assertTrue(gc_thread_heap(false) == 0, __LINE__, "Destroyed thread heap still in use");
+  
+  gc_stats before, after;
+  gc_get_stats(&before);
+  void *shared = gc_alloc_or_die(1024);
+  gc_get_stats(&after);
+  assertTrue(after.heap_bytes == before.heap_bytes + 1024, __LINE__, "Block %p not allocated from the shared heap after destroying the thread heap", shared);
+  gc_collect();
+}
+
+static const char *mappedPtr;
+
+void testMappedFile() {
+  const char *path = "/tmp/simplegc_test.mapped";
+  size_t page = sysconf(_SC_PAGESIZE);
+  FILE *file = fopen(path, "wb");
+  for (size_t i = 0; i < 2 * page; i++) {
+    fputc('a' + i % 26, file);
+  }
+  fclose(file);
+  
+  int fd = open(path, O_RDONLY);
+  assertTrue(gc_alloc_mapped_file(fd, 1, page, 0) == 0, __LINE__, "Mapping from an unaligned offset should fail");
+  mappedPtr = (const char *)gc_alloc_mapped_file(fd, page, page, GC_MAP_SEQUENTIAL | GC_MAP_WILLNEED);
+  close(fd);
+  remove(path);
+  
+  assertTrue(mappedPtr && mappedPtr[0] == (char)('a' + page % 26), __LINE__, "Mapped file doesn't have the file's contents");
+  gc_collect();
+  gc_stats stats;
+  gc_get_stats(&stats);
+  assertTrue(stats.mapped_bytes == page, __LINE__, "Expected %zu mapped bytes, got %zu", page, stats.mapped_bytes);
+  mappedPtr = 0;
+}
+
+void testMappedFileUnmappedWhenUnreachable() {
+  gc_collect();
+  gc_stats stats;
+  gc_get_stats(&stats);
+  assertTrue(stats.mapped_bytes == 0, __LINE__, "Unreachable mapping not unmapped, %zu mapped bytes", stats.mapped_bytes);
+}
+
+void testMappedFilesTriggerCollections() {
+  const char *path = "/tmp/simplegc_test.mapped";
+  size_t length = 1024 * 1024;
+  FILE *file = fopen(path, "wb");
+  fseek(file, length - 1, SEEK_SET);
+  fputc(0, file);
+  fclose(file);
+  
+  gc_stats before, after;
+  gc_get_stats(&before);
+  int fd = open(path, O_RDONLY);
+  for (int i = 0; i < 32; i++) {
+    gc_alloc_mapped_file(fd, 0, length, 0);
+  }
+  close(fd);
+  remove(path);
+  gc_get_stats(&after);
+  assertTrue(after.collections > before.collections, __LINE__, "Mapping 32MB of garbage started no collection");
+  assertTrue(after.mapped_bytes < 16 * length, __LINE__, "Expected unreachable mappings to be unmapped, %zu bytes mapped", after.mapped_bytes);
+}
+
+static gc_buffer_pool_t *bufferPool;
+static void *heldBuffers[4];
+
+void testBufferPoolRead() {
+  const char *path = "/tmp/simplegc_test.buffers";
+  FILE *file = fopen(path, "wb");
+  fputs("read straight into a GC buffer", file);
+  fclose(file);
+  
+  bufferPool = gc_buffer_pool_create(4096, 4);
+  size_t count;
+  const struct iovec *iovecs = gc_buffer_pool_iovecs(bufferPool, &count);
+  assertTrue(count == 4, __LINE__, "Expected 4 iovecs, got %zu", count);
+  
+  for (int i = 0; i < 4; i++) {
+    heldBuffers[i] = gc_buffer_alloc(bufferPool);
+    assertTrue(heldBuffers[i] && ((uint64_t)heldBuffers[i] & 4095) == 0, __LINE__, "Buffer %p isn't page aligned", heldBuffers[i]);
+    size_t index = gc_buffer_index(bufferPool, heldBuffers[i]);
+    assertTrue(index < 4 && iovecs[index].iov_base == heldBuffers[i], __LINE__, "Buffer %p doesn't match its iovec", heldBuffers[i]);
+  }
+  
+  int fd = open(path, O_RDONLY);
+  ssize_t n = pread(fd, heldBuffers[0], 4096, 0);
+  close(fd);
+  remove(path);
+  assertTrue(n == 30 && !memcmp(heldBuffers[0], "read straight into a GC buffer", 30), __LINE__, "pread into a pool buffer failed");
+  
+  // All 4 are reachable, so a collection can't recycle any
+  assertTrue(gc_buffer_alloc(bufferPool) == 0, __LINE__, "Allocated a 5th buffer from a pool of 4");
+  memset(heldBuffers, 0, sizeof(heldBuffers));
+}
+
+void testBufferPoolRecycles() {
+  void *buffer = gc_buffer_alloc(bufferPool);
+  assertTrue(buffer != 0, __LINE__, "Unreachable buffers weren't recycled");
+  buffer = 0;
+}
+
+// A coroutine frame the way the coroutine machinery gets one: the promise
+// type's operator new with the size of the whole frame
+struct TestFrame {
+  void *held;
+  char locals[100];
+};
+
+void testCoroutineFramesFreedEagerly() {
+  gc_stats before, after;
+  gc_get_stats(&before);
+  
+  TestFrame *frame = (TestFrame *)gc_coroutine_promise::operator new(sizeof(TestFrame));
+  frame->held = gc_alloc_or_die(16);
+  gc_get_stats(&after);
+  assertTrue(after.heap_bytes - before.heap_bytes == 128 + 16, __LINE__, "Expected a 128 byte frame and its block, heap grew %zu bytes", after.heap_bytes - before.heap_bytes);
+  
+  // A suspended frame keeps what it holds alive
+  gc_collect();
+  assertTrue('\xab' != *(char *)frame->held, __LINE__, "Block %p held by a frame was collected", frame->held);
+  
+  void *first = frame;
+  gc_free(frame->held);
+  gc_coroutine_promise::operator delete(frame, sizeof(TestFrame));
+  gc_get_stats(&after);
+  assertTrue(after.heap_bytes == before.heap_bytes, __LINE__, "Freed frame still in the heap, %zu bytes", after.heap_bytes - before.heap_bytes);
+  
+  // The next frame of that size reuses the cached one
+  frame = (TestFrame *)gc_coroutine_promise::operator new(sizeof(TestFrame));
+  assertTrue(frame == first && frame->held == 0, __LINE__, "Frame %p wasn't reused (or zeroed) from the cache", frame);
+  gc_coroutine_promise::operator delete(frame);
+}
+
+void testCachedFramesRespectMaxHeap() {
+  gc_free(gc_alloc_frame(128));
+  gc_collect();
+  gc_stats stats;
+  gc_get_stats(&stats);
+  gc_set_max_heap(stats.heap_bytes + 64);
+  void *frame = gc_alloc_frame(128);
+  gc_set_max_heap(TEST_MAX_HEAP);
+  assertTrue(frame == 0, __LINE__, "Cached frame %p allocated past the heap limit", frame);
+}
+
+static char *fiberMemory;
+static gc_stack_t *fiberStack;
+
+// Allocates into a fiber stack slot in a frame of its own, so no copy of
+// the block's address is left on our stack
+__attribute__((noinline)) void allocIntoSlot(void **slot) {
+  *slot = gc_alloc_or_die(1024);
+}
+
+void testSuspendedFiberStack() {
+  const size_t size = 64 * 1024;
+  fiberMemory = (char *)malloc(size);
+  memset(fiberMemory, 0, size);
+  fiberStack = gc_register_stack(fiberMemory, size);
+  
+  // A fiber that suspended with one block in its live part, one below it
+  void **top = (void **)(fiberMemory + size);
+  allocIntoSlot(&top[-4]);
+  allocIntoSlot(&top[-100]);
+  char *live = (char *)top[-4];
+  gc_switch_stack(fiberStack, 0, &top[-8]);
+  
+  clearStack();
+  gc_collect();
+  assertTrue('\xab' != live[512], __LINE__, "Block %p on a suspended stack was collected", live);
+  assertTrue('\xab' == ((char *)top[-100])[512], __LINE__, "Block %p below the saved stack pointer NOT collected", top[-100]);
+  
+  // Untouched, so the next collection reuses what it found
+  gc_collect();
+  gc_stats stats;
+  gc_get_stats(&stats);
+  assertTrue(stats.stacks_cached >= 1, __LINE__, "Untouched stack was rescanned");
+  assertTrue('\xab' != live[512], __LINE__, "Block %p on a cached stack was collected", live);
+  
+  top[-5] = gc_alloc_or_die(1024);
+  gc_touch_stack(fiberStack);
+  gc_collect();
+  gc_get_stats(&stats);
+  assertTrue(stats.stacks_scanned >= 1, __LINE__, "Touched stack wasn't rescanned");
+  assertTrue('\xab' != ((char *)top[-5])[512], __LINE__, "Block %p on a touched stack was collected", top[-5]);
+  
+  gc_unregister_stack(fiberStack);
+  free(fiberMemory);
+}
+
+void testPreciseRoots() {
+  void **rooted = (void **)gc_alloc_or_die(1024);
+  char *alsoRooted = (char *)gc_alloc_or_die(1024);
+  GC_ROOT(rooted); GC_ROOT(alsoRooted);
+  *rooted = gc_alloc_or_die(1024);
+  char *unrooted = (char *)gc_alloc_or_die(1024);
+  
+  gc_set_precise_roots(true);
+  gc_collect();
+  gc_set_precise_roots(false);
+  
+  assertTrue('\xab' != ((char *)rooted)[512], __LINE__, "Rooted block %p was collected", rooted);
+  assertTrue('\xab' != ((char *)*rooted)[512], __LINE__, "Block %p reachable from a root was collected", *rooted);
+  assertTrue('\xab' != alsoRooted[512], __LINE__, "Block %p rooted on the same line was collected", alsoRooted);
+  assertTrue('\xab' == unrooted[512], __LINE__, "Block %p only on the stack NOT collected in precise mode", unrooted);
+}
+
+// An interpreter's VM state, in memory the collector doesn't scan
+struct TestVM {
+  void *globals[4];
+  void *stack[16];
+};
+static TestVM *testVMs[2];
+
+void markTestVM(gc_mark_ctx *mark, void *ctx) {
+  TestVM *vm = (TestVM *)ctx;
+  for (int i = 0; i < 4; i++) {
+    gc_mark_precise(mark, vm->globals[i]);
+  }
+  gc_mark_range(mark, vm->stack, sizeof(vm->stack));
+}
+
+void testRootCallbacks() {
+  for (int i = 0; i < 2; i++) {
+    testVMs[i] = (TestVM *)calloc(1, sizeof(TestVM));
+    testVMs[i]->globals[1] = gc_alloc_or_die(1024);
+    testVMs[i]->stack[3] = gc_alloc_or_die(1024);
+    gc_add_root_callback(markTestVM, testVMs[i]);
+  }
+  gc_collect();
+  for (int i = 0; i < 2; i++) {
+    assertTrue('\xab' != ((char *)testVMs[i]->globals[1])[512], __LINE__, "Block %p marked precisely was collected", testVMs[i]->globals[1]);
+    assertTrue('\xab' != ((char *)testVMs[i]->stack[3])[512], __LINE__, "Block %p in a marked range was collected", testVMs[i]->stack[3]);
+    gc_remove_root_callback(markTestVM, testVMs[i]);
+  }
+}
+
+void testRootCallbacksRemoved() {
+  gc_collect();
+  for (int i = 0; i < 2; i++) {
+    assertTrue('\xab' == ((char *)testVMs[i]->globals[1])[512], __LINE__, "Block %p NOT collected after its callback was removed", testVMs[i]->globals[1]);
+    free(testVMs[i]);
+  }
+}
+
+// A variable length record whose header says which slots are pointers
+struct TestRecord {
+  uint32_t count;
+  uint32_t pointer_mask;
+  uint64_t slots[1];
+};
+static TestRecord *tracedRecord;
+
+void traceTestRecord(void *obj, gc_mark_ctx *mark) {
+  TestRecord *record = (TestRecord *)obj;
+  for (uint32_t i = 0; i < record->count; i++) {
+    if (record->pointer_mask & (1 << i)) {
+      gc_mark_precise(mark, (void *)record->slots[i]);
+    }
+  }
+}
+
+void testTracedBlocks() {
+  tracedRecord = (TestRecord *)gc_alloc_traced(sizeof(TestRecord) + 3 * sizeof(uint64_t), traceTestRecord);
+  tracedRecord->count = 4;
+  tracedRecord->pointer_mask = 0x5;
+  tracedRecord->slots[0] = (uint64_t)gc_alloc_or_die(1024);
+  tracedRecord->slots[1] = (uint64_t)gc_alloc_or_die(1024);   // Looks like a pointer, but is data
+  tracedRecord->slots[2] = (uint64_t)gc_alloc_or_die(1024);
+  gc_collect();
+  assertTrue('\xab' != ((char *)tracedRecord->slots[0])[512], __LINE__, "Block %p reported by a trace function was collected", (void *)tracedRecord->slots[0]);
+  assertTrue('\xab' != ((char *)tracedRecord->slots[2])[512], __LINE__, "Block %p reported by a trace function was collected", (void *)tracedRecord->slots[2]);
+}
+
+void testTracedBlocksIgnoreData() {
+  gc_collect();
+  assertTrue('\xab' == ((char *)tracedRecord->slots[1])[512], __LINE__, "Block %p only in a data slot NOT collected", (void *)tracedRecord->slots[1]);
+  tracedRecord = 0;
+}
+
+static void *taggedBlocks[10];
+static int overBudgetTag = -1;
+
+void tagOverBudget(uint8_t tag, size_t live_bytes, size_t budget, void *ctx) {
+  overBudgetTag = tag;
+  *(size_t *)ctx = live_bytes;
+}
+
+void testTagAccounting() {
+  size_t reported = 0;
+  gc_set_tag_budget(7, 500, tagOverBudget, &reported);
+  for (int i = 0; i < 10; i++) {
+    taggedBlocks[i] = gc_alloc_tagged(100, 7);
+  }
+  gc_collect();
+  
+  gc_tag_stats stats;
+  gc_get_tag_stats(7, &stats);
+  assertTrue(stats.live_objects == 10 && stats.live_bytes == 1000, __LINE__, "Expected 10 live blocks, 1000 bytes for tag 7, got %zu, %zu", stats.live_objects, stats.live_bytes);
+  assertTrue(overBudgetTag == 7 && reported == 1000, __LINE__, "Budget callback not called for tag 7");
+  
+  memset(taggedBlocks, 0, sizeof(taggedBlocks));
+  gc_set_tag_budget(7, 0, 0, 0);
+}
+
+void testTagAccountingOnThreadHeap() {
+  gc_thread_heap(true);
+  for (int i = 0; i < 5; i++) {
+    taggedBlocks[i] = gc_alloc_tagged(100, 9);
+  }
+  gc_thread_heap(false);
+  gc_collect();
+  
+  gc_tag_stats stats;
+  gc_get_tag_stats(9, &stats);
+  assertTrue(stats.live_objects == 5, __LINE__, "Expected 5 live blocks for tag 9 allocated on a thread heap, got %zu", stats.live_objects);
+  memset(taggedBlocks, 0, sizeof(taggedBlocks));
+}
+
+static char *reservedBlock;
+
+void testReserve() {
+  assertTrue(gc_reserve(1024 * 1024, GC_RESERVE_PREFAULT), __LINE__, "gc_reserve failed");
+  assertTrue(!gc_reserve(1024 * 1024, 0), __LINE__, "Second gc_reserve should fail");
+  
+  size_t heapBefore = gc_heap_bytes();
+  reservedBlock = (char *)gc_alloc(100);
+  assertTrue(gc_heap_bytes() == heapBefore + 112, __LINE__, "Expected a 100 byte block to be charged 112 bytes, got %zu", gc_heap_bytes() - heapBefore);
+  gc_stats stats;
+  gc_get_stats(&stats);
+  assertTrue(stats.reserve_bytes >= 1024 * 1024, __LINE__, "Expected a 1MB reserve, got %zu", stats.reserve_bytes);
+  assertTrue(stats.reserve_used_bytes >= 100, __LINE__, "Expected the block to come from the reserve, %zu used", stats.reserve_used_bytes);
+  
+  // Reclaimed blocks are reused, zeroed, for the next block of their size
+  memset(reservedBlock, 1, 100);
+  char *freed = reservedBlock;
+  gc_free(reservedBlock);
+  reservedBlock = (char *)gc_alloc(100);
+  assertTrue(reservedBlock == freed, __LINE__, "Expected %p to be reused, got %p", freed, reservedBlock);
+  assertTrue(reservedBlock[0] == 0 && reservedBlock[99] == 0, __LINE__, "Reused block not zeroed");
+  gc_free(reservedBlock);
+  assertTrue(gc_heap_bytes() == heapBefore, __LINE__, "Freeing a reserve block left %zu bytes charged", gc_heap_bytes() - heapBefore);
+  reservedBlock = 0;
+}
+
+static void **censusBlocks;
+
+// Every census block comes from the gc_alloc call here, so they share a
+// site.  The barrier keeps optimized builds from turning it into a tail
+// call, which would make the site whatever called censusAlloc.
+void * __attribute__((noinline)) censusAlloc(size_t size) {
+  void *block = gc_alloc(size);
+  __asm__ __volatile__("" : : "r"(block) : "memory");
+  return block;
+}
+
+const gc_site_census *findCensusSite(const gc_site_census *sites, size_t count, void *site) {
+  for (size_t i = 0; i < count; i++) {
+    if (sites[i].site == site) {
+      return &sites[i];
+    }
+  }
+  return 0;
+}
+
+void testCensusBySite() {
+  gc_set_census(true);
+  censusBlocks = (void **)gc_alloc_or_die(100 * sizeof(void *));
+  for (int i = 0; i < 50; i++) {
+    censusBlocks[i] = censusAlloc(64);
+  }
+  gc_collect();
+  
+  gc_site_census sites[16];
+  size_t count = std::min(gc_get_census(sites, 16), (size_t)16);
+  void *site = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (sites[i].live_objects == 50 && sites[i].live_bytes == 50 * 64) {
+      site = sites[i].site;
+    }
+  }
+  assertTrue(site != 0, __LINE__, "No census site with the 50 live blocks");
+  
+  // Grow the site by 30 blocks and drop 10 of the originals
+  for (int i = 50; i < 80; i++) {
+    censusBlocks[i] = censusAlloc(64);
+  }
+  for (int i = 0; i < 10; i++) {
+    censusBlocks[i] = 0;
+  }
+  gc_collect();
+  
+  count = std::min(gc_get_census(sites, 16), (size_t)16);
+  const gc_site_census *grown = findCensusSite(sites, count, site);
+  assertTrue(grown && grown->live_objects == 70, __LINE__, "Expected 70 live blocks at the census site");
+  assertTrue(grown && grown->objects_delta == 20 && grown->bytes_delta == 20 * 64, __LINE__, "Expected the census site to grow by 20 blocks");
+  
+  censusBlocks = 0;
+  gc_set_census(false);
+}
+
+__attribute__((noinline)) void allocGarbage(size_t bytes) {
+  for (size_t i = 0; i < bytes / 1024; i++) {
+    gc_alloc_or_die(1024);
+  }
+}
+
+static void **pacerLive;
+
+void testPacerBacksOffFutileCollections() {
+  gc_set_max_heap(0);
+  pacerLive = (void **)gc_alloc_or_die(1024 * sizeof(void *));
+  for (int i = 0; i < 1024; i++) {
+    pacerLive[i] = gc_alloc_or_die(1024);
+  }
+  
+  // The second collection finds nothing to reclaim
+  gc_collect();
+  gc_collect();
+  gc_stats stats;
+  gc_get_stats(&stats);
+  assertTrue(stats.trigger_bytes > stats.heap_goal, __LINE__, "Trigger %zu didn't back off past the goal %zu", stats.trigger_bytes, stats.heap_goal);
+  
+  // Until a collection pays off again
+  allocGarbage(2 * 1024 * 1024);
+  clearStack();
+  gc_collect();
+  gc_get_stats(&stats);
+  assertTrue(stats.trigger_bytes == stats.heap_goal, __LINE__, "Trigger %zu still backed off from the goal %zu", stats.trigger_bytes, stats.heap_goal);
+  
+  pacerLive = 0;
+  gc_set_max_heap(TEST_MAX_HEAP);
+}
+
+static void **verifyList;
+
+void testVerifyMode() {
+  // Each collection and region end below aborts if it would free a block
+  // the reference mark finds reachable
+  gc_set_verify(true);
+  
+  verifyList = (void **)gc_alloc_or_die(sizeof(void *));
+  *verifyList = gc_alloc_or_die(sizeof(void *));
+  
+  tracedRecord = (TestRecord *)gc_alloc_traced(sizeof(TestRecord) + sizeof(uint64_t), traceTestRecord);
+  tracedRecord->count = 2;
+  tracedRecord->pointer_mask = 0x1;
+  tracedRecord->slots[0] = (uint64_t)gc_alloc_or_die(1024);
+  tracedRecord->slots[1] = (uint64_t)gc_alloc_or_die(1024);   // Data, not a reference
+  gc_collect();
+  
+  gc_region_begin();
+  for (int i = 0; i < 10; i++) {
+    gc_alloc_or_die(1024);
+  }
+  escapedPtr = gc_alloc_or_die(1024);
+  gc_region_end();
+  gc_collect();
+  
+  assertTrue('\xab' != *(char *)*verifyList, __LINE__, "Block %p unexpectedly collected in verify mode", *verifyList);
+  assertTrue('\xab' != ((char *)tracedRecord->slots[0])[512], __LINE__, "Traced block %p unexpectedly collected in verify mode", (void *)tracedRecord->slots[0]);
+  assertTrue('\xab' == ((char *)tracedRecord->slots[1])[512], __LINE__, "Block %p only in a data slot NOT collected in verify mode", (void *)tracedRecord->slots[1]);
+  assertTrue('\xab' != *(char *)escapedPtr, __LINE__, "Escaped block %p unexpectedly reclaimed in verify mode", escapedPtr);
+  
+  verifyList = 0;
+  tracedRecord = 0;
+  escapedPtr = 0;
+  gc_set_verify(false);
 }
 
 int main(int argc, const char * argv[]) {
   gc_debug_overwrite_reclaimed_blocks(true);
   gc_debug_enable_verbose_logging(true);
-  gc_debug_set_max_heap(TEST_MAX_HEAP); // 8mb
+  gc_set_max_heap(TEST_MAX_HEAP); // 8mb
 
   void *scrambled_p = testGCNotCollectingLocallyReferencedBlock();
   clearStack();
@@ -132,6 +863,99 @@ int main(int argc, const char * argv[]) {
   testChurnBeyondHeap();
   clearStack();
 
+  testPacerKeepsHeapUnderGoal();
+  clearStack();
+
+  testPauseGoalDefersSweep();
+  clearStack();
+
+  testIdleCollection();
+  clearStack();
+
+  testRegionReclaimsTemporaries();
+  clearStack();
+
+  testTraceRecording();
+  clearStack();
+
+  testCensusBySite();
+  clearStack();
+
+  testHeapsCollectIndependently();
+  clearStack();
+
+  testThreadHeapPublish();
+  clearStack();
+
+  testMappedFile();
+  clearStack();
+
+  testMappedFileUnmappedWhenUnreachable();
+  clearStack();
+
+  testBufferPoolRead();
+  clearStack();
+
+  testBufferPoolRecycles();
+  clearStack();
+
+  testCoroutineFramesFreedEagerly();
+  clearStack();
+
+  testCachedFramesRespectMaxHeap();
+  clearStack();
+
+  testSuspendedFiberStack();
+  clearStack();
+
+  testPreciseRoots();
+  clearStack();
+
+  testRootCallbacks();
+  clearStack();
+
+  testRootCallbacksRemoved();
+  clearStack();
+
+  testTracedBlocks();
+  clearStack();
+
+  testTracedBlocksIgnoreData();
+  clearStack();
+
+  testTagAccounting();
+  clearStack();
+
+  testTagAccountingOnThreadHeap();
+  clearStack();
+
+  testReserve();
+  clearStack();
+
+  testRegionReclaimsLowestAndHighest();
+  clearStack();
+
+  testRegionEndWithPendingSweep();
+  clearStack();
+
+  testTaggedPointers();
+  clearStack();
+
+  testTaggedPointersIgnoredWithoutDecoding();
+  clearStack();
+
+  testVerifyMode();
+  clearStack();
+
+  testThreadHeapDestroy();
+  clearStack();
+
+  testMappedFilesTriggerCollections();
+  clearStack();
+
+  testPacerBacksOffFutileCollections();
+  clearStack();
+
   printf("%d passed, %d failed\n", testPassed, testFailed);
   
   return 0;
@@ -0,0 +1,288 @@
+/**
+ *   Copyright 2015 Garrick Toubassi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include "gc.h"
+#include "gc_trace.h"
+
+/**
+ *  simplegc_replay replays a trace recorded with gc_trace_record against
+ *  the allocator and collector, to reproduce a heap's shape and pause
+ *  profile offline.
+ *
+ *  Blocks are allocated again the way they were recorded (frames, tagged
+ *  and so on; traced blocks are scanned conservatively, since their trace
+ *  functions aren't in the trace), explicit frees are repeated with
+ *  gc_free and so are explicit collections.  Collections the trace shows
+ *  were started by the pacer or a full heap are expected to happen on their
+ *  own.
+ *
+ *  What keeps blocks alive is rebuilt from the recorded stores: a store
+ *  into a block is applied at the same offset in the replayed block, and a
+ *  store anywhere else (a global or the stack) becomes a root, held in the
+ *  slots array (which is reachable from the data segment).  A new block's
+ *  only reference may be on the recording's stack, which isn't recorded,
+ *  so it is also held there until the trace's next collection.  Anything
+ *  else the replayed collector frees on its own.  Events that refer to a
+ *  block it already freed, because the recording kept it alive through
+ *  references that weren't recorded, are skipped and counted as lost.
+ */
+
+static const size_t no_slot = SIZE_MAX;
+
+struct replay_block {
+  size_t size;
+  void *ptr;
+  size_t pin;   // Slot holding ptr while the block is new, or no_slot
+};
+
+// Replayed blocks, keyed by their address in the recording, and the other
+// way round.  Neither keeps the blocks alive.
+static std::map<uint64_t, replay_block> blocks;
+static std::map<void *, uint64_t> recorded_addresses;
+
+// Roots, keyed by the address of the recorded slot, and the blocks still
+// pinned because they were allocated since the trace's last collection
+static std::map<uint64_t, size_t> roots;
+static std::vector<uint64_t> young;
+
+static void **slots;
+static size_t slot_capacity;
+static std::vector<size_t> free_slots;
+
+static size_t take_slot(void *ptr) {
+  if (free_slots.empty()) {
+    size_t capacity = slot_capacity ? slot_capacity * 2 : 1024;
+    void **grown = (void **)gc_alloc(capacity * sizeof(void *));
+    if (!grown) {
+      fprintf(stderr, "Out of memory growing slots to %zu\n", capacity);
+      exit(1);
+    }
+    if (slots) {
+      memcpy(grown, slots, slot_capacity * sizeof(void *));
+    }
+    for (size_t i = capacity; i > slot_capacity; i--) {
+      free_slots.push_back(i - 1);
+    }
+    slots = grown;
+    slot_capacity = capacity;
+  }
+  size_t slot = free_slots.back();
+  free_slots.pop_back();
+  slots[slot] = ptr;
+  return slot;
+}
+
+static void release_slot(size_t slot) {
+  slots[slot] = 0;
+  free_slots.push_back(slot);
+}
+
+static void forget_block(std::map<uint64_t, replay_block>::iterator block) {
+  if (block->second.pin != no_slot) {
+    release_slot(block->second.pin);
+  }
+  recorded_addresses.erase(block->second.ptr);
+  blocks.erase(block);
+}
+
+/**
+ *  Finds the replayed block allocated at address in the recording, or
+ *  returns blocks.end() if there is none or the collector has freed it.
+ */
+static std::map<uint64_t, replay_block>::iterator live_block(uint64_t address) {
+  auto block = blocks.find(address);
+  if (block != blocks.end() && gc_block_size(block->second.ptr) == 0) {
+    forget_block(block);
+    return blocks.end();
+  }
+  return block;
+}
+
+static void *replay_alloc(const gc_trace_entry &entry) {
+  // Atomic blocks have no public allocator, so they are replayed as plain ones
+  if (entry.flags & GC_TRACE_FRAME) {
+    return gc_alloc_frame(entry.value);
+  }
+  if (entry.tag) {
+    return gc_alloc_tagged(entry.value, (uint8_t)entry.tag);
+  }
+  return gc_alloc(entry.value);
+}
+
+static void usage(const char *program) {
+  fprintf(stderr, "usage: %s [--max-heap bytes] [--pause-goal ns] [--verbose] trace\n", program);
+  exit(2);
+}
+
+int main(int argc, const char * argv[]) {
+  const char *path = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--max-heap") && i + 1 < argc) {
+      gc_set_max_heap(strtoull(argv[++i], 0, 10));
+    }
+    else if (!strcmp(argv[i], "--pause-goal") && i + 1 < argc) {
+      gc_set_pause_goal(strtoull(argv[++i], 0, 10));
+    }
+    else if (!strcmp(argv[i], "--verbose")) {
+      gc_debug_enable_verbose_logging(true);
+    }
+    else if (argv[i][0] != '-' && !path) {
+      path = argv[i];
+    }
+    else {
+      usage(argv[0]);
+    }
+  }
+  if (!path) {
+    usage(argv[0]);
+  }
+
+  FILE *file = fopen(path, "rb");
+  if (!file || !gc_trace_read_header(file)) {
+    fprintf(stderr, "%s is not a SimpleGC trace\n", path);
+    return 1;
+  }
+
+  size_t events = 0, allocs = 0, frees = 0, stores = 0, collects = 0, failed = 0, lost = 0;
+  size_t allocated_bytes = 0, peak_heap = 0;
+  uint64_t start_ns = gc_now_ns();
+
+  gc_trace_entry entry;
+  while (fread(&entry, sizeof(entry), 1, file) == 1) {
+    events++;
+    switch (entry.event) {
+      case GC_TRACE_ALLOC: {
+        void *ptr = replay_alloc(entry);
+        if (!ptr) {
+          failed++;
+          break;
+        }
+        // Either address may belong to a block that was freed without us
+        // seeing it, by the recording's collector or by ours
+        auto stale = blocks.find(entry.address);
+        if (stale != blocks.end()) {
+          forget_block(stale);
+        }
+        auto reused = recorded_addresses.find(ptr);
+        if (reused != recorded_addresses.end()) {
+          forget_block(blocks.find(reused->second));
+        }
+        blocks[entry.address] = { entry.value, ptr, take_slot(ptr) };
+        recorded_addresses[ptr] = entry.address;
+        young.push_back(entry.address);
+        allocs++;
+        allocated_bytes += entry.value;
+        // Only allocations grow the heap, so this is where it peaks
+        peak_heap = std::max(peak_heap, gc_heap_bytes());
+        break;
+      }
+      case GC_TRACE_FREE: {
+        auto block = live_block(entry.address);
+        if (block == blocks.end()) {
+          break;
+        }
+        // Swept and region blocks are left to our own collector
+        if (entry.flags == GC_TRACE_FREE_EXPLICIT) {
+          void *ptr = block->second.ptr;
+          forget_block(block);
+          gc_free(ptr);
+          frees++;
+        }
+        else {
+          forget_block(block);
+        }
+        break;
+      }
+      case GC_TRACE_STORE: {
+        auto value = live_block(entry.value);
+        void *replayed_value = value == blocks.end() ? 0 : value->second.ptr;
+        if (entry.value && !replayed_value) {
+          lost++;
+        }
+        
+        // Find the block containing the slot, if any
+        auto block = blocks.upper_bound(entry.address);
+        if (block != blocks.begin()) {
+          --block;
+        }
+        if (block != blocks.end() && entry.address >= block->first && entry.address - block->first < block->second.size) {
+          uint64_t offset = entry.address - block->first;
+          block = live_block(block->first);
+          if (block == blocks.end()) {
+            lost++;
+          }
+          else if (offset + sizeof(void *) <= block->second.size) {
+            *(void **)((char *)block->second.ptr + offset) = replayed_value;
+            stores++;
+          }
+          break;
+        }
+        
+        // Otherwise the slot is a root
+        auto root = roots.find(entry.address);
+        if (root != roots.end()) {
+          release_slot(root->second);
+          roots.erase(root);
+        }
+        if (replayed_value) {
+          roots[entry.address] = take_slot(replayed_value);
+        }
+        stores++;
+        break;
+      }
+      case GC_TRACE_COLLECT:
+        if (entry.flags == GC_TRACE_TRIGGER_EXPLICIT || entry.flags == GC_TRACE_TRIGGER_IDLE) {
+          gc_collect();
+          collects++;
+        }
+        // From here on the new blocks live only as long as the recorded
+        // roots and stores reach them
+        for (uint64_t address : young) {
+          auto block = blocks.find(address);
+          if (block != blocks.end() && block->second.pin != no_slot) {
+            release_slot(block->second.pin);
+            block->second.pin = no_slot;
+          }
+        }
+        young.clear();
+        break;
+    }
+  }
+  fclose(file);
+
+  uint64_t elapsed_ns = gc_now_ns() - start_ns;
+  gc_stats stats;
+  gc_get_stats(&stats);
+
+  printf("events            %zu\n", events);
+  printf("allocations       %zu (%zu bytes, %zu failed)\n", allocs, allocated_bytes, failed);
+  printf("frees             %zu\n", frees);
+  printf("stores            %zu\n", stores);
+  printf("lost references   %zu\n", lost);
+  printf("collections       %zu (%zu explicit)\n", stats.collections, collects);
+  printf("peak heap         %zu bytes\n", peak_heap);
+  printf("final live        %zu bytes\n", stats.live_bytes);
+  printf("pause p50/p90/p99 %.3f / %.3f / %.3f ms\n", stats.pause_p50_ns / 1e6, stats.pause_p90_ns / 1e6, stats.pause_p99_ns / 1e6);
+  printf("pause max         %.3f ms\n", stats.pause_max_ns / 1e6);
+  printf("elapsed           %.3f ms\n", elapsed_ns / 1e6);
+  return 0;
+}
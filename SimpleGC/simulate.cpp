@@ -0,0 +1,255 @@
+/**
+ *   Copyright 2015 Garrick Toubassi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include "gc_trace.h"
+
+/**
+ *  simplegc_simulate evaluates GC policies against a recorded trace without
+ *  running the application or the collector.  It replays the allocation
+ *  and free events against a model heap and decides when to collect using
+ *  the policy given on the command line:
+ *
+ *    --growth ratio        Heap goal is the live set after a collection times
+ *                          (1 + ratio), like the pacer's growth ratio
+ *    --min-heap bytes      Floor for the heap goal
+ *    --max-heap bytes      Ceiling for the heap goal
+ *    --full-every n        Only every nth collection is full, the others are
+ *                          minor collections that trace and reclaim just the
+ *                          blocks allocated since the previous collection
+ *    --size-classes list   Comma separated size classes that allocations are
+ *                          rounded up to (larger ones round up to 4k pages)
+ *    --release-after n     Free memory is only given back to the OS once the
+ *                          heap has stayed below it for n collections
+ *    --mark-ns-per-byte x  Mark cost, defaults to the average measured in
+ *                          the trace's collections
+ *
+ *  Pauses are estimated as bytes traced times the per byte mark cost.  A
+ *  block is considered dead from the point the trace freed it, which for
+ *  swept blocks is the recorded collection that found them, so simulated
+ *  collections can only find garbage as early as the recorded ones did.
+ */
+
+struct sim_block {
+  size_t size;
+  bool young;
+};
+
+struct sim_policy {
+  double growth = 1.0;
+  size_t min_heap = 4 * 1024 * 1024;
+  size_t max_heap = 0;
+  size_t full_every = 1;
+  std::vector<size_t> size_classes;
+  size_t release_after = 0;
+  double mark_ns_per_byte = 0;
+};
+
+static size_t size_class(const sim_policy &policy, size_t size) {
+  if (policy.size_classes.empty()) {
+    return size;
+  }
+  auto size_class = std::lower_bound(policy.size_classes.begin(), policy.size_classes.end(), size);
+  if (size_class != policy.size_classes.end()) {
+    return *size_class;
+  }
+  return (size + 4095) & ~(size_t)4095;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr, "usage: %s [--growth ratio] [--min-heap bytes] [--max-heap bytes] [--full-every n]\n"
+                  "       [--size-classes s1,s2,...] [--release-after n] [--mark-ns-per-byte x] trace\n", program);
+  exit(2);
+}
+
+int main(int argc, const char * argv[]) {
+  sim_policy policy;
+  const char *path = 0;
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "--growth") && has_value) {
+      policy.growth = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--min-heap") && has_value) {
+      policy.min_heap = strtoull(argv[++i], 0, 10);
+    }
+    else if (!strcmp(argv[i], "--max-heap") && has_value) {
+      policy.max_heap = strtoull(argv[++i], 0, 10);
+    }
+    else if (!strcmp(argv[i], "--full-every") && has_value) {
+      policy.full_every = std::max(1ULL, strtoull(argv[++i], 0, 10));
+    }
+    else if (!strcmp(argv[i], "--size-classes") && has_value) {
+      for (const char *p = argv[++i]; *p; p += strspn(p, ",")) {
+        char *end;
+        policy.size_classes.push_back(strtoull(p, &end, 10));
+        if (end == p) {
+          usage(argv[0]);
+        }
+        p = end;
+      }
+      std::sort(policy.size_classes.begin(), policy.size_classes.end());
+    }
+    else if (!strcmp(argv[i], "--release-after") && has_value) {
+      policy.release_after = strtoull(argv[++i], 0, 10);
+    }
+    else if (!strcmp(argv[i], "--mark-ns-per-byte") && has_value) {
+      policy.mark_ns_per_byte = atof(argv[++i]);
+    }
+    else if (argv[i][0] != '-' && !path) {
+      path = argv[i];
+    }
+    else {
+      usage(argv[0]);
+    }
+  }
+  if (!path) {
+    usage(argv[0]);
+  }
+
+  FILE *file = fopen(path, "rb");
+  if (!file || !gc_trace_read_header(file)) {
+    fprintf(stderr, "%s is not a SimpleGC trace\n", path);
+    return 1;
+  }
+
+  // Read the whole trace up front, the mark cost has to be known before simulating
+  std::vector<gc_trace_entry> entries;
+  gc_trace_entry entry;
+  double recorded_mark_ns = 0, recorded_marked_bytes = 0;
+  while (fread(&entry, sizeof(entry), 1, file) == 1) {
+    entries.push_back(entry);
+    if (entry.event == GC_TRACE_COLLECT) {
+      recorded_mark_ns += entry.address;
+      recorded_marked_bytes += entry.value;
+    }
+  }
+  fclose(file);
+
+  if (policy.mark_ns_per_byte == 0) {
+    if (recorded_marked_bytes == 0) {
+      fprintf(stderr, "Trace has no collections to measure mark cost from, use --mark-ns-per-byte\n");
+      return 1;
+    }
+    policy.mark_ns_per_byte = recorded_mark_ns / recorded_marked_bytes;
+  }
+
+  std::unordered_map<uint64_t, sim_block> live;
+  size_t live_young = 0, live_old = 0;   // Reachable bytes
+  size_t dead_young = 0, dead_old = 0;   // Unreachable but not yet collected
+  size_t requested = 0, rounded = 0;
+  size_t goal = policy.min_heap;
+  size_t minor = 0, full = 0;
+  double total_pause_ns = 0, max_pause_ns = 0;
+  size_t peak_in_use = 0, committed = 0, peak_committed = 0;
+  std::deque<size_t> recent_in_use;     // In-use high water mark per collection interval
+  size_t interval_in_use = 0;
+
+  for (const gc_trace_entry &event : entries) {
+    switch (event.event) {
+      case GC_TRACE_ALLOC: {
+        size_t size = size_class(policy, event.value);
+        requested += event.value;
+        rounded += size;
+        live[event.address] = { size, true };
+        live_young += size;
+        break;
+      }
+      case GC_TRACE_FREE: {
+        auto block = live.find(event.address);
+        if (block == live.end()) {
+          break;
+        }
+        size_t size = block->second.size;
+        bool young = block->second.young;
+        (young ? live_young : live_old) -= size;
+        // Region ends and explicit frees give memory back right away, swept
+        // blocks are garbage until a simulated collection finds them
+        if (event.flags == GC_TRACE_FREE_SWEPT) {
+          (young ? dead_young : dead_old) += size;
+        }
+        live.erase(block);
+        break;
+      }
+    }
+
+    size_t in_use = live_young + live_old + dead_young + dead_old;
+    peak_in_use = std::max(peak_in_use, in_use);
+    interval_in_use = std::max(interval_in_use, in_use);
+    committed = std::max(committed, in_use);
+    peak_committed = std::max(peak_committed, committed);
+
+    if (in_use < goal) {
+      continue;
+    }
+
+    // Collect
+    bool is_full = (minor + full + 1) % policy.full_every == 0;
+    double pause_ns;
+    if (is_full) {
+      pause_ns = (live_young + live_old) * policy.mark_ns_per_byte;
+      dead_young = dead_old = 0;
+      full++;
+    }
+    else {
+      pause_ns = live_young * policy.mark_ns_per_byte;
+      dead_young = 0;
+      minor++;
+    }
+    total_pause_ns += pause_ns;
+    max_pause_ns = std::max(max_pause_ns, pause_ns);
+
+    // Survivors are old now
+    for (auto &block : live) {
+      block.second.young = false;
+    }
+    live_old += live_young;
+    live_young = 0;
+
+    size_t after = live_old + dead_old;
+    goal = std::max((size_t)(after * (1 + policy.growth)), policy.min_heap);
+    if (policy.max_heap > 0) {
+      goal = std::min(goal, policy.max_heap);
+    }
+
+    // Release free memory the heap hasn't needed for release_after collections
+    recent_in_use.push_back(interval_in_use);
+    while (recent_in_use.size() > policy.release_after) {
+      recent_in_use.pop_front();
+    }
+    size_t keep = after;
+    for (size_t high_water : recent_in_use) {
+      keep = std::max(keep, high_water);
+    }
+    committed = std::min(committed, keep);
+    interval_in_use = after;
+  }
+
+  printf("events                %zu\n", entries.size());
+  printf("mark cost             %.3f ns/byte\n", policy.mark_ns_per_byte);
+  printf("collections           %zu (%zu full, %zu minor)\n", full + minor, full, minor);
+  printf("total pause estimate  %.3f ms\n", total_pause_ns / 1e6);
+  printf("max pause estimate    %.3f ms\n", max_pause_ns / 1e6);
+  printf("peak heap in use      %zu bytes\n", peak_in_use);
+  printf("peak footprint        %zu bytes\n", peak_committed);
+  printf("size class overhead   %.1f%%\n", requested ? 100.0 * (rounded - requested) / requested : 0);
+  return 0;
+}